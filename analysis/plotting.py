@@ -4,106 +4,120 @@ import pylab as pl
 import matplotlib
 #matplotlib.rcParams['savefig.dpi'] = 2 * matplotlib.rcParams['savefig.dpi']
 from matplotlib.collections import LineCollection
-import yaml
 import os
 import time
 
-def load(base):
-    conf = yaml.load(open(base+".conf"))
-    pegs = np.fromfile(base+".pegs",  dtype='float')
-    pegs = pegs.reshape(pegs.shape[0]/2, 2)
+# the header of a <name>.plinko file, see pfile.h
+PFILE_HEADER = np.dtype([
+    ('magic', 'S8'), ('version', 'u8'), ('content', 'u8'),
+    ('radius', 'f8'), ('damp', 'f8'), ('wall', 'f8'), ('top', 'f8'),
+    ('seed', 'u8'), ('hash', 'u8'), ('nparticles', 'u8'), ('timepoints', 'u8'),
+    ('npegs', 'u8'), ('pegs_offset', 'u8'),
+    ('record_size', 'u8'), ('nrecords', 'u8'),
+    ('records_offset', 'u8'), ('index_offset', 'u8'),
+    ('shard', 'u8'), ('nshards', 'u8'), ('first', 'u8')
+])
+PFILE_EVENTS = 5
+
+# one entry of an event log, t_event in plinkolib.h
+EVENT = np.dtype([
+    ('t', 'f8'), ('pos', 'f8', 2), ('vel', 'f8', 2), ('type', 'i4'), ('peg', 'i4')
+])
+
+def open_plinko(base):
+    """
+    Maps each section of base.plinko without reading it.  Returns the
+    header as a dict, the pegs, and the records: an (nrecords, n) array for
+    fixed size records (of EVENT for an event log), or for variable ones the
+    flat doubles of all of them with the index of nrecords+1 byte offsets
+    """
+    fn = base+".plinko"
+    h = np.fromfile(fn, dtype=PFILE_HEADER, count=1)[0]
+    conf = dict((k, h[k].item()) for k in PFILE_HEADER.names)
+
+    pegs = np.memmap(fn, dtype='float', mode='r', offset=conf['pegs_offset'],
+            shape=(conf['npegs'], 2))
+
+    if conf['content'] == PFILE_EVENTS:
+        records = np.memmap(fn, dtype=EVENT, mode='r', offset=conf['records_offset'],
+                shape=(conf['nrecords'],))
+        return conf, pegs, records
+
+    if conf['record_size']:
+        n = conf['record_size'] // 8
+        records = np.memmap(fn, dtype='float', mode='r', offset=conf['records_offset'],
+                shape=(conf['nrecords'], n))
+        return conf, pegs, records
+
+    index = np.memmap(fn, dtype='uint64', mode='r', offset=conf['index_offset'],
+            shape=(conf['nrecords']+1,))
+    records = np.memmap(fn, dtype='float', mode='r', offset=conf['records_offset'],
+            shape=(int(index[-1]) // 8,))
+    return conf, pegs, (records, index)
+
+def sample_events(events, times):
+    """
+    Positions of a logged flight at any times within it, each from the last
+    event at or before it along that event's arc (event_position in C)
+    """
+    times = np.asarray(times, dtype='float')
+    k = np.clip(np.searchsorted(events['t'], times, side='right') - 1, 0, len(events)-1)
+    e = events[k]
+    dt = times - e['t']
+    x = e['pos'][:,0] + e['vel'][:,0]*dt
+    y = e['pos'][:,1] + e['vel'][:,1]*dt - 0.5*dt*dt
+    return np.array([x, y]).T
+
+def load(base, interval=0.008):
+    """
+    The records of base.plinko, with an event log sampled every interval
+    """
+    conf, pegs, records = open_plinko(base)
 
-    if os.path.exists(base+'.density'):
-        track = np.fromfile(base+".density", dtype='float')
-        track = track.reshape(-1, conf['timepoints']+1, 2)
-    elif os.path.exists(base+'.track'):
-        track = np.fromfile(base+".track", dtype='float')
-        track = track.reshape(track.shape[0]/2, 2)
+    if conf['content'] == PFILE_EVENTS:
+        track = sample_events(records, np.arange(0, records['t'][-1], interval))
+    elif conf['record_size'] == 8:
+        track = records[:,0]
+    else:
+        track = records
 
     return conf, track, pegs
 
-def hist(tracks, conf, bins=500):
-    bins = (bins*np.array([conf['top']/conf['wall'], 1.0])).astype('int')
-    h,_,_ = np.histogram2d(tracks[:,1:,1].flatten(), tracks[:,1:,0].flatten(), bins=bins)
-    h[0,0] = 0
-    return h
-
-def density_hist(base, bins=500):
+def hist(base):
     """
-    Complete density of all tracks plotted at the same time using a histogram (coarse grained)
+    The occupancy histogram plinko-density accumulated over [0,wall]x[0,top],
+    one row per bin up the board (the bins are set when it is run)
     """
-    conf, track, pegs = load(base)
-
-    h = hist(track, conf, bins)
-    pl.imshow(np.log(h+1), cmap=pl.cm.bone, interpolation='nearest', origin='lower')
+    conf, pegs, counts = open_plinko(base)
+    return np.array(counts)
 
-def density_hist_movie(base, bins=500, skip=1, frames=500, size=10):
+def density_hist(base):
     """
-    A movie of the hist2d plots of hte trajectories
+    Complete density of all tracks plotted at the same time using a histogram (coarse grained)
     """
-    conf, track, pegs = load(base)
-
-    nbins = (bins*np.array([conf['top']/conf['wall'], 1.0])).astype('int')
-    bins = [np.linspace(0, conf['top'], nbins[0]),
-            np.linspace(0, conf['wall'], nbins[1])]
-
-    fig = pl.figure(figsize=(size,size*conf['top']/conf['wall']))
-
-    for t in xrange(max(frames, track.shape[1]/skip)):
-        tmp = track[:,t*skip+1,:]
-        h,_,_ = np.histogram2d(tmp[:,1].flatten(), tmp[:,0].flatten(), bins=bins)
-        h[0,0] = 0
-
-        pl.imshow(h, cmap=pl.cm.bone, interpolation='nearest', origin='lower')
-        pl.xticks([])
-        pl.yticks([])
-        pl.tight_layout()
-        pl.savefig(base+'-movie-%05d.png' % t)
+    h = hist(base)
+    pl.imshow(np.log(h+1), cmap=pl.cm.bone, interpolation='nearest', origin='lower')
 
-def tracks_movie(base, skip=1, frames=500, size=10):
+def plot_density(base, size=14, save=False):
     """
-    A movie of each particle as a point
+    The histogram of plinko-density drawn over its board, on a log scale
     """
-    conf, track, pegs = load(base)
+    conf, pegs, counts = open_plinko(base)
 
     fig = pl.figure(figsize=(size,size*conf['top']/conf['wall']))
-    plot = None
-
-    for t in xrange(1,max(frames, track.shape[1]/skip)):
-        tmp = track[:,t*skip,:]
-        if not ((tmp[:,0] > 0) & (tmp[:,1] > 0) & (tmp[:,0] < conf['wall']) & (tmp[:,1] < conf['top'])).any():
-            continue
-
-        if plot is None:
-            plot = pl.plot(tmp[:,0], tmp[:,1], 'k,', alpha=1.0, ms=0.1)[0]
-            pl.xticks([])
-            pl.yticks([])
-            pl.xlim(0,conf['wall'])
-            pl.ylim(0,conf['top'])
-            pl.tight_layout()
-        else:
-            plot.set_xdata(tmp[:,0])
-            plot.set_ydata(tmp[:,1])
-        pl.draw()
-        pl.savefig(base+'-movie-%05d.png' % (t-1))
-
-def plot_density(base, thin=False, start=0, size=14, save=False):
-    conf, track, pegs = load(base)
-
-    linethick = 2*0.0125 if thin else 0.3
-    fig = pl.figure(figsize=(size,size*conf['top']/conf['wall']))
-
-    for i in xrange(conf['nparticles']):
-        l = int(track[i,0,0])
-        pl.plot(track[i,1:l-2,0], track[i,1:l-2,1], 'k-', linewidth=linethick, alpha=0.01)
+    pl.imshow(np.log(np.array(counts)+1), cmap=pl.cm.bone_r, interpolation='nearest',
+            origin='lower', extent=(0, conf['wall'], 0, conf['top']))
+    for peg in pegs:
+        pl.gca().add_artist(pl.Circle(peg, conf['radius'], color='k', fill=False, lw=0.5))
 
     pl.xlim(0, conf['wall'])
     pl.ylim(0, conf['top'])
-    pl.show()
     pl.xticks([])
     pl.yticks([])
     pl.tight_layout()
-    return track
+    pl.show()
+    if save:
+        pl.savefig(base+".png", dpi=200)
 
 def plot_file(base, thin=True, start=0, size=10, save=False):
     conf, track, pegs = load(base)
@@ -151,6 +165,41 @@ def plot_file_color(base, thin=True, start=0, size=14, save=False):
     if save:
         pl.savefig(base+".png", dpi=200)
 
+def load_stats(base):
+    """
+    The sections of base.stats that plinko-stats wrote, by name: particles,
+    moments, cups, bounces and time, each an array of its rows
+    """
+    sections, name = {}, None
+    for line in open(base+".stats"):
+        if line.startswith('#'):
+            name = line[1:].split(':')[0].split()[0]
+            sections[name] = []
+        else:
+            sections[name].append(line.split())
+    moments = dict((r[0], map(float, r[1:])) for r in sections.pop('moments'))
+    out = dict((k, np.array(v, dtype='float')) for k, v in sections.items())
+    out['moments'] = moments
+    return out
+
+def plot_basin(base, size=8):
+    """
+    The map plinko-basin made of where drops end up, each initial
+    condition it evaluated drawn in the colour of its cup.  Later (finer)
+    points are drawn over earlier ones, so a map still being refined can be
+    shown as it is
+    """
+    conf, pegs, records = open_plinko(base)
+    r = np.array(records)
+    pl.figure(figsize=(size,size))
+    if np.all(r[:,1] == r[0,1]):
+        pl.scatter(r[:,0], r[:,3], c=r[:,3], s=2, lw=0, cmap=pl.cm.jet)
+    else:
+        pl.scatter(r[:,0], r[:,1], c=r[:,3], s=40*4.0**(r[:,2].min()-r[:,2]),
+                lw=0, cmap=pl.cm.jet, marker='s')
+    pl.tight_layout()
+    pl.show()
+
 def plot_y(base):
     conf, track, pegs = load(base)
     pl.figure(figsize=(6,6))
@@ -159,13 +208,13 @@ def plot_y(base):
 """
 plot_file('small', True)
 
-h = np.fromfile("./stats/real-damped.track", dtype='float')
+conf, h, pegs = load("./stats/real-damped")
 a = pl.hist(abs(h-3.5), bins=1000, histtype='step', linewidth=0.2)
 pl.xlim(0,3.5)
 pl.semilogy()
 
-h = np.fromfile("./bounces/test.track", dtype='float')
-print yaml.load(open("./bounces/test.conf"))
+conf, h, pegs = load("./bounces/test")
+print conf
 print h.std()
 a = pl.hist(h[h < h.std()/500], bins=400, histtype='step', linewidth=0.3)
 """
@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "plinkolib.h"
+#include "roots/quartic.h"
+#include "batch.h"
+#include "counters.h"
+
+/*===========================================================================
+ *  Every lane runs trackCollision's loop, but the peg search of all of them
+ *  is done together in rounds: each round every lane steps one cell of its
+ *  walk, the pegs there that survive peg_unreachable go into one list of
+ *  polynomials solved ROOT_BLOCK at a time, and each lane keeps its
+ *  earliest hit.  A lane whose search ends where earliest_grid_collision's
+ *  would applies its event and starts the next search in the following
+ *  round, so lanes never wait on each other and the blocks stay full.
+ *
+ *  Before any solving, a round's pegs are screened in float, SIMD across
+ *  all of them, for when each could first be touched and by when it
+ *  surely is.  Only the pegs that might hit before every other of their
+ *  lane are solved in double, so the results are those of solving all.
+ *=========================================================================*/
+#define SCREEN_SEGMENTS 4
+
+typedef struct {
+    int n;
+    long id[BATCH_LANES];
+    int nbounces[BATCH_LANES];
+    double time[BATCH_LANES];
+    double px[BATCH_LANES], py[BATCH_LANES];
+    double vx[BATCH_LANES], vy[BATCH_LANES];
+
+    // the walls and floor, then the best peg so far
+    int event[BATCH_LANES];
+    double tevent[BATCH_LANES];
+    double tpeg[BATCH_LANES];
+    double pegx[BATCH_LANES], pegy[BATCH_LANES];
+
+    t_walk walk[BATCH_LANES];
+    int ntested[BATCH_LANES];
+    int tested[BATCH_LANES][GRID_MAXTESTED];
+} t_lanes;
+
+/* pegs met in one round.  Each is first screened in float for the span
+ * [tlo, thi] its root can fall in, then only those that could still beat
+ * their lane's best get polynomials, by coefficient for the block solver */
+typedef struct {
+    int n, max, nsolve;
+    int *lane, *solve;
+    double *peg, *tlimit;
+    float *dx, *dy, *vx, *vy, *T, *tlo, *thi;
+    double (*poly)[DEGSIZE][ROOT_BLOCK];
+    double *tmax, *roots;
+} t_pairs;
+
+static void lane_copy(t_lanes *b, int to, int from){
+    b->id[to] = b->id[from];
+    b->nbounces[to] = b->nbounces[from];
+    b->time[to] = b->time[from];
+    b->px[to] = b->px[from];
+    b->py[to] = b->py[from];
+    b->vx[to] = b->vx[from];
+    b->vy[to] = b->vy[from];
+    b->event[to] = b->event[from];
+    b->tevent[to] = b->tevent[from];
+    b->tpeg[to] = b->tpeg[from];
+    b->pegx[to] = b->pegx[from];
+    b->pegy[to] = b->pegy[from];
+    b->walk[to] = b->walk[from];
+    b->ntested[to] = b->ntested[from];
+    memcpy(b->tested[to], b->tested[from], sizeof(int)*b->ntested[from]);
+}
+
+static void start_search(t_lanes *b, int l, double wall, t_grid *grid){
+    double pos[2] = {b->px[l], b->py[l]}, vel[2] = {b->vx[l], b->vy[l]};
+
+    b->event[l] = next_wall_collision(pos, vel, wall, &b->tevent[l]);
+    walk_start(&b->walk[l], pos, grid);
+    b->ntested[l] = 0;
+    b->tpeg[l] = NAN;
+    b->pegx[l] = b->pegy[l] = 0;
+}
+
+static void search_cell(t_lanes *b, int l, double R, t_grid *grid, t_pairs *pairs){
+    int i, k, n, seen, p;
+    int ids[MAX(grid->maxcell, 1)];
+    double pegs[2*MAX(grid->maxcell, 1)];
+    double pos[2] = {b->px[l], b->py[l]}, vel[2] = {b->vx[l], b->vy[l]};
+    double poly[DEGSIZE], tmax, tlimit;
+
+    walk_cell(&b->walk[l], pos, vel, grid);
+    n = grid_cell_pegs(grid, b->walk[l].ix, b->walk[l].iy, pegs, ids);
+    if (n == 0) return;
+
+    tmax = isnan(b->tevent[l]) ? INFINITY : b->tevent[l];
+    tlimit = isnan(b->tpeg[l]) ? tmax : MIN(tmax, b->tpeg[l]);
+
+    for (k=0; k<n; k++){
+        i = ids[k];
+
+        seen = 0;
+        for (int j=0; j<b->ntested[l]; j++)
+            if (b->tested[l][j] == i) seen = 1;
+        if (seen) continue;
+        if (b->ntested[l] < GRID_MAXTESTED) b->tested[l][b->ntested[l]++] = i;
+
+        cullstats.ntests++;
+        if (peg_unreachable(pos, vel, R, &pegs[2*k], tlimit)){
+            cullstats.nculled++;
+            continue;
+        }
+
+        if (polycapture){
+            build_peg_poly(pos, vel, R, &pegs[2*k], poly);
+            fwrite(poly, sizeof(double), DEGSIZE, polycapture);
+        }
+
+        p = pairs->n++;
+        pairs->lane[p] = l;
+        pairs->peg[2*p+0] = pegs[2*k+0];
+        pairs->peg[2*p+1] = pegs[2*k+1];
+        pairs->tlimit[p] = tlimit;
+        pairs->T[p] = isinf(tlimit) ? 0 : tlimit;
+        pairs->dx[p] = pos[0] - pegs[2*k+0];
+        pairs->dy[p] = pos[1] - pegs[2*k+1];
+        pairs->vx[p] = vel[0];
+        pairs->vy[p] = vel[1];
+    }
+}
+
+static void screen_pairs(t_pairs *pairs, double R){
+    /*
+     * Narrows each pair's [0, tlimit] to when both x and y are within R
+     * of the peg's, splits that into SCREEN_SEGMENTS and bounds the arc
+     * over each by a box (x is linear, y concave with its top at t = vy).
+     * tlo is the start of the first segment whose box comes within R of
+     * the peg, INFINITY if none does, so no root lies before it.  A ball outside R
+     * at t = 0 and inside it at the end of some segment must have met the
+     * peg by then, which is thi.  The margin m is far above float's
+     * rounding, so either bound only ever errs on the loose side.
+     */
+    #pragma omp simd
+    for (int p=0; p<pairs->n; p++){
+        float dx = pairs->dx[p], dy = pairs->dy[p];
+        float vx = pairs->vx[p], vy = pairs->vy[p], T = pairs->T[p];
+        float m = 1e-5f*(1 + fabsf(dx) + fabsf(dy) + (fabsf(vx) + fabsf(vy))*T + T*T + vy*vy);
+        float rout = (float)R + m, rin = (float)R - m;
+        int outside = dx*dx + dy*dy > rout*rout;
+
+        // |dx + vx t| <= rout, all or nothing when vx is too slow to tell
+        int slow = fabsf(vx)*T <= m;
+        float t0 = (-rout - dx)/vx, t1 = (rout - dx)/vx;
+        float lo = vx > 0 ? t0 : t1, hi = vx > 0 ? t1 : t0;
+        lo = slow || lo < 0 ? 0 : lo;
+        hi = slow || hi > T ? T : hi;
+
+        // y >= -rout between the roots of a concave quadratic, and once
+        // above rout it is only back under it after the later root
+        float below = vy*vy + 2*(dy + rout), above = vy*vy + 2*(dy - rout);
+        float sb = sqrtf(MAX(below, 0)), sa = sqrtf(MAX(above, 0));
+        float ys = dy < -rout ? vy - sb : 0;
+        ys = dy > rout ? vy + sa : ys;
+        lo = ys > lo ? ys : lo;
+        hi = vy + sb < hi ? vy + sb : hi;
+        hi = below < 0 ? -1 : hi;
+        float w = (hi - lo)/SCREEN_SEGMENTS;
+        float tlo = INFINITY, thi = INFINITY;
+
+        #pragma GCC unroll 4
+        for (int s=SCREEN_SEGMENTS-1; s>=0; s--){
+            float ta = lo + w*s;
+            float tb = s == SCREEN_SEGMENTS-1 ? hi : lo + w*(s+1);
+            float xa = dx + vx*ta, xb = dx + vx*tb;
+            float ya = dy + (vy - 0.5f*ta)*ta, yb = dy + (vy - 0.5f*tb)*tb;
+            float ylo = MIN(ya, yb);
+            float yhi = (vy > ta && vy < tb) ? dy + 0.5f*vy*vy : MAX(ya, yb);
+            // how far each range is from 0, 0 if it straddles it
+            float gx = 0.5f*(fabsf(xa) + fabsf(xb) - fabsf(xb - xa));
+            float gy = 0.5f*(fabsf(ylo) + fabsf(yhi) - (yhi - ylo));
+
+            tlo = gx*gx + gy*gy <= rout*rout ? ta : tlo;
+            thi = (outside && rin > 0 && xb*xb + yb*yb < rin*rin) ? tb : thi;
+        }
+
+        // an infinite tlimit comes in as T = 0, with nothing ruled out
+        pairs->tlo[p] = T > 0 ? (lo <= hi ? tlo : INFINITY) : 0;
+        pairs->thi[p] = T > 0 ? thi : INFINITY;
+    }
+}
+
+static void solve_pairs(t_lanes *b, t_pairs *pairs, double R){
+    int p, q, l;
+    double poly[DEGSIZE], pos[2], vel[2], tcut[BATCH_LANES];
+
+    screen_pairs(pairs, R);
+
+    // a pair can only be the earliest if it may hit before all the others
+    // of its lane certainly have, and before its lane's best so far
+    for (l=0; l<b->n; l++)
+        tcut[l] = isnan(b->tpeg[l]) ? INFINITY : b->tpeg[l];
+    for (p=0; p<pairs->n; p++)
+        tcut[pairs->lane[p]] = MIN(tcut[pairs->lane[p]], pairs->thi[p]);
+
+    pairs->nsolve = 0;
+    for (p=0; p<pairs->n; p++){
+        l = pairs->lane[p];
+        if (pairs->tlo[p] > tcut[l]*(1 + 1e-6)){
+            cullstats.nscreened++;
+            continue;
+        }
+
+        pos[0] = b->px[l]; pos[1] = b->py[l];
+        vel[0] = b->vx[l]; vel[1] = b->vy[l];
+        build_peg_poly(pos, vel, R, &pairs->peg[2*p], poly);
+
+        q = pairs->nsolve++;
+        for (int j=0; j<DEGSIZE; j++)
+            pairs->poly[q/ROOT_BLOCK][j][q%ROOT_BLOCK] = poly[j];
+        pairs->tmax[q] = pairs->tlimit[p];
+        pairs->solve[q] = p;
+    }
+
+    // the tail block is padded with t^4 + 1, which has no roots
+    for (q=pairs->nsolve; q%ROOT_BLOCK; q++){
+        for (int j=0; j<DEGSIZE; j++)
+            pairs->poly[q/ROOT_BLOCK][j][q%ROOT_BLOCK] = (j == 0 || j == DEG);
+        pairs->tmax[q] = INFINITY;
+    }
+
+    // a root past tlimit could not be the next event anyway
+    COUNT_START(start);
+    for (int k=0; k*ROOT_BLOCK<pairs->nsolve; k++)
+        SMALLEST_ROOT_BLOCK(pairs->poly[k], &pairs->tmax[k*ROOT_BLOCK],
+                &pairs->roots[k*ROOT_BLOCK]);
+    COUNT_CYCLES(solve, start);
+}
+
+static int search_done(t_lanes *b, int l, t_grid *grid){
+    // where earliest_grid_collision stops its walk, see there
+    double vel[2] = {b->vx[l], b->vy[l]};
+    double tmax = isnan(b->tevent[l]) ? INFINITY : b->tevent[l];
+
+    if (!isnan(b->tpeg[l]) && b->tpeg[l] <= b->walk[l].tnext) return 1;
+    if (b->walk[l].tnext > tmax) return 1;
+    return !walk_advance(&b->walk[l], vel, grid);
+}
+
+static int finish_event(t_lanes *b, int l, double damp, t_batch_event event, void *ctx){
+    /* applies the event that lane l found, returns 0 if its particle ends */
+    double pos[2] = {b->px[l], b->py[l]}, vel[2] = {b->vx[l], b->vy[l]};
+    double peg[2] = {b->pegx[l], b->pegy[l]};
+    int bounced, more = 1;
+
+    // a peg wins ties with the walls and floor
+    if (!isnan(b->tpeg[l]) && (isnan(b->tevent[l]) || b->tevent[l] >= b->tpeg[l])){
+        b->event[l] = RESULT_COLLISION;
+        b->tevent[l] = b->tpeg[l];
+    }
+
+    if (event)
+        more = event(ctx, b->id[l], b->event[l], b->tevent[l], peg, pos, vel);
+    bounced = apply_event(pos, vel, damp, b->event[l], b->tevent[l], peg);
+    b->px[l] = pos[0]; b->py[l] = pos[1];
+    b->vx[l] = vel[0]; b->vy[l] = vel[1];
+    if (b->event[l] != RESULT_NOTHING) b->time[l] += b->tevent[l];
+    if (!bounced) return 0;
+
+    b->time[l] += EPS;
+    b->nbounces[l]++;
+    return more && b->nbounces[l] < MAXBOUNCES;
+}
+
+long trackCollisionBatch(double R, double wall, double damp, t_grid *grid,
+        t_batch_next next, t_batch_done done, void *ctx){
+    return trackCollisionBatchEvents(R, wall, damp, grid, next, done, NULL, ctx);
+}
+
+long trackCollisionBatchEvents(double R, double wall, double damp, t_grid *grid,
+        t_batch_next next, t_batch_done done, t_batch_event event, void *ctx){
+    int l, p, q, more = 1;
+    long ntracked = 0;
+    double pos[2], vel[2], t;
+    t_result res;
+
+    t_lanes *b = malloc(sizeof(t_lanes));
+    b->n = 0;
+
+    // no round can add more than a full cell of pegs per lane
+    t_pairs pairs;
+    pairs.max = BATCH_LANES*grid->maxcell + ROOT_BLOCK;
+    pairs.poly = malloc(sizeof(*pairs.poly)*(pairs.max/ROOT_BLOCK + 1));
+    pairs.tmax = malloc(sizeof(double)*(pairs.max + ROOT_BLOCK));
+    pairs.roots = malloc(sizeof(double)*(pairs.max + ROOT_BLOCK));
+    pairs.lane = malloc(sizeof(int)*pairs.max);
+    pairs.solve = malloc(sizeof(int)*pairs.max);
+    pairs.peg = malloc(sizeof(double)*2*pairs.max);
+    pairs.tlimit = malloc(sizeof(double)*pairs.max);
+    float *screen = malloc(sizeof(float)*7*pairs.max);
+    pairs.dx = screen;
+    pairs.dy = screen + pairs.max;
+    pairs.vx = screen + 2*pairs.max;
+    pairs.vy = screen + 3*pairs.max;
+    pairs.tlo = screen + 4*pairs.max;
+    pairs.thi = screen + 5*pairs.max;
+    pairs.T = screen + 6*pairs.max;
+
+    while (1){
+        // keep the lanes full, only waiting on next() with nothing in flight
+        while (more && b->n < BATCH_LANES){
+            l = b->n;
+            int got = next(ctx, l == 0, &b->id[l], pos, vel);
+            if (got == 0) more = 0;
+            if (got != 1) break;
+            b->px[l] = pos[0]; b->py[l] = pos[1];
+            b->vx[l] = vel[0]; b->vy[l] = vel[1];
+            b->nbounces[l] = 0;
+            b->time[l] = 0;
+            start_search(b, l, wall, grid);
+            b->n++;
+        }
+        if (b->n == 0) break;
+
+        COUNT_START(start);
+        pairs.n = 0;
+        for (l=0; l<b->n; l++)
+            search_cell(b, l, R, grid, &pairs);
+        solve_pairs(b, &pairs, R);
+
+        // in the order the pegs were met, as earliest_grid_collision keeps them
+        for (q=0; q<pairs.nsolve; q++){
+            p = pairs.solve[q];
+            l = pairs.lane[p];
+            t = pairs.roots[q];
+            if (isnan(t)) continue;
+            cullstats.nhits++;
+            if ((isnan(b->tpeg[l]) || b->tpeg[l] > t) && t > 0){
+                b->tpeg[l] = t;
+                b->pegx[l] = pairs.peg[2*p+0];
+                b->pegy[l] = pairs.peg[2*p+1];
+            }
+        }
+
+        for (l=0; l<b->n; l++){
+            if (!search_done(b, l, grid)) continue;
+            if (finish_event(b, l, damp, event, ctx)){
+                start_search(b, l, wall, grid);
+                continue;
+            }
+
+            res.time_total = b->time[l];
+            res.xfinal = b->event[l] == RESULT_DONE ? b->px[l] : NAN;
+            res.yfinal = NAN;
+            res.nbounces = b->nbounces[l];
+            done(ctx, b->id[l], &res);
+            ntracked++;
+
+            // the last lane takes its place and is looked at next
+            lane_copy(b, l, --b->n);
+            l--;
+        }
+        COUNT_CYCLES(round, start);
+    }
+
+    free(pairs.poly);
+    free(pairs.tmax);
+    free(pairs.roots);
+    free(pairs.lane);
+    free(pairs.solve);
+    free(pairs.peg);
+    free(pairs.tlimit);
+    free(screen);
+    free(b);
+    return ntracked;
+}
@@ -0,0 +1,42 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include "plinkolib.h"
+
+/*
+ * trackCollision for many particles at once.  Up to BATCH_LANES particles
+ * are held in structure of arrays form and advanced one event at a time
+ * in lockstep, so the peg polynomials of all of them are solved together
+ * by SMALLEST_ROOT_BLOCK, the vectorized isolate_smallest_root_block unless
+ * the Makefile's SOLVER picks another.  A particle that finishes
+ * is handed to done() and its lane refilled straight away from next().
+ *
+ * next(ctx, wait, &id, pos, vel) returns 1 with the next particle, 0 once
+ * there are none left, or -1 if there is none yet (only when wait is 0,
+ * which it is while other particles are still in flight).
+ *
+ * A particle's result does not depend on which others share its batch.
+ * It can differ from trackCollision's in the last bits of each collision
+ * time, which a chaotic board then grows.
+ */
+#define BATCH_LANES 64
+
+typedef int  (*t_batch_next)(void *ctx, int wait, long *id, double *pos, double *vel);
+typedef void (*t_batch_done)(void *ctx, long id, t_result *res);
+typedef int  (*t_batch_event)(void *ctx, long id, int result, double tcoll,
+        double *peg, double *pos, double *vel);
+
+/* returns the number of particles tracked */
+long trackCollisionBatch(double R, double wall, double damp, t_grid *grid,
+        t_batch_next next, t_batch_done done, void *ctx);
+
+/* the same, also handing each event a particle meets to event(ctx, id,
+ * result, tcoll, peg, pos, vel) in the order it meets them, with the state
+ * it met it in (not to be changed).  A zero return ends that particle's
+ * flight once the event is applied.  This is how shadow.c looks into the
+ * flights plinko writes: run one particle on its own and it is flown as
+ * in any batch */
+long trackCollisionBatchEvents(double R, double wall, double damp, t_grid *grid,
+        t_batch_next next, t_batch_done done, t_batch_event event, void *ctx);
+
+#endif
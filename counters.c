@@ -0,0 +1,80 @@
+#include <time.h>
+#include <string.h>
+#include "counters.h"
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+void progress_start(t_progress *p, long first){
+    p->start = now();
+    p->first = first;
+    p->nevents = 0;
+}
+
+void progress_report(t_progress *p, long next){
+    double secs = now() - p->start;
+    if (secs <= 0) secs = 1e-9;
+    printf("%li particles, %.1f s, %.0f particles/s, %.3g events/s\n",
+        next, secs, (next - p->first) / secs, p->nevents / secs);
+    fflush(stdout);
+}
+
+#ifdef PLINKO_COUNTERS
+
+t_counters counters;
+#pragma omp threadprivate(counters)
+
+static t_counters total;
+
+void counters_fold(void){
+    t_count *from = (t_count*)&counters, *to = (t_count*)&total;
+
+    #pragma omp critical(counters_fold)
+    for (size_t k=0; k<sizeof(t_counters)/sizeof(t_count); k++)
+        to[k] += from[k];
+    memset(&counters, 0, sizeof(t_counters));
+}
+
+static void print_hist(FILE *out, const char *name, t_count *hist){
+    fprintf(out, "    %s:", name);
+    for (int k=0; k<COUNTER_BINS; k++)
+        if (hist[k]) fprintf(out, " <2^%i %llu", k, hist[k]);
+    fprintf(out, "\n");
+}
+
+static void print_timer(FILE *out, const char *name, t_count calls, t_count cycles,
+        t_count *hist){
+    fprintf(out, "%s: %llu calls, %.1f cycles each\n", name, calls,
+        (double)cycles / (calls ? calls : 1));
+    print_hist(out, "cycles", hist);
+}
+
+void counters_print(FILE *out){
+    static const char *names[COUNTER_RESULTS] = {"nothing", "collision",
+        "wall left", "wall right", "done"};
+    t_counters *c = &total;
+
+    fprintf(out, "find_root_pair: %llu calls, %llu at NMAX\n", c->pair_calls, c->pair_nmax);
+    print_hist(out, "steps", c->pair_steps);
+    fprintf(out, "bairstow_smallest_root: %llu calls, %llu NaN\n",
+        c->bairstow_calls, c->bairstow_nan);
+
+    fprintf(out, "isolate_smallest_root_block: %llu blocks, %llu lanes left to isolate_smallest_root\n",
+        c->block_calls, c->block_fallback);
+    fprintf(out, "bracketed_root: %llu calls, %llu at ISOLATE_NMAX\n",
+        c->isolate_calls, c->isolate_nmax);
+    print_hist(out, "steps", c->isolate_steps);
+
+    fprintf(out, "events:");
+    for (int k=0; k<COUNTER_RESULTS; k++)
+        fprintf(out, " %s %llu%s", names[k], c->events[k], k < COUNTER_RESULTS-1 ? "," : "\n");
+
+    print_timer(out, "next_collision", c->collision_calls, c->collision_cycles, c->collision_hist);
+    print_timer(out, "batch round", c->round_calls, c->round_cycles, c->round_hist);
+    print_timer(out, "solve_pairs", c->solve_calls, c->solve_cycles, c->solve_hist);
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef __COUNTERS_H__
+#define __COUNTERS_H__
+
+#include <stdio.h>
+
+/*
+ * Counters on the hot path of the simulation, built in only with
+ * -DPLINKO_COUNTERS (make COUNTERS=1).  Without it every COUNT_* below is
+ * empty and nothing of this is compiled in.
+ *
+ * Every thread counts into its own copy, which COUNTERS_FOLD() adds to
+ * the run's total once the thread is done, and COUNTERS_PRINT() shows:
+ *
+ *      the steps of each find_root_pair, as a histogram, and how often it
+ *      gave up at NMAX; how often bairstow_smallest_root found no root
+ *
+ *      for the isolate solver, the blocks isolate_smallest_root_block
+ *      solved and the lanes of them it left to isolate_smallest_root,
+ *      and the steps of each bracketed_root as a histogram
+ *
+ *      the events applied, by RESULT_*
+ *
+ *      the cycles spent in each next_collision, and in each round of
+ *      trackCollisionBatch and the solve_pairs in it, in total and as
+ *      histograms (rdtsc on x86, nanoseconds elsewhere)
+ *
+ * Histograms have a bin per power of two, bin k counting values in
+ * [2^(k-1), 2^k), bin 0 the zeros.
+ */
+#define COUNTER_BINS 48
+#define COUNTER_RESULTS 5   // RESULT_NOTHING .. RESULT_DONE
+
+typedef unsigned long long int t_count;
+
+typedef struct {
+    t_count pair_calls, pair_nmax;
+    t_count pair_steps[COUNTER_BINS];
+    t_count bairstow_calls, bairstow_nan;
+    t_count block_calls, block_fallback;
+    t_count isolate_calls, isolate_nmax;
+    t_count isolate_steps[COUNTER_BINS];
+
+    t_count events[COUNTER_RESULTS];
+
+    t_count collision_calls, collision_cycles;
+    t_count collision_hist[COUNTER_BINS];
+    t_count round_calls, round_cycles;
+    t_count round_hist[COUNTER_BINS];
+    t_count solve_calls, solve_cycles;
+    t_count solve_hist[COUNTER_BINS];
+} t_counters;
+
+/* a report every so often of how far a run is and how fast it goes */
+typedef struct {
+    double start;
+    long first;
+    t_count nevents;
+} t_progress;
+
+void progress_start(t_progress *p, long first);
+void progress_report(t_progress *p, long next);
+
+#ifdef PLINKO_COUNTERS
+
+extern t_counters counters;
+#pragma omp threadprivate(counters)
+
+void counters_fold(void);
+void counters_print(FILE *out);
+
+static inline int counter_bin(t_count v){
+    int k = v ? 64 - __builtin_clzll(v) : 0;
+    return k < COUNTER_BINS ? k : COUNTER_BINS-1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline t_count counter_clock(void){ return __builtin_ia32_rdtsc(); }
+#else
+#include <time.h>
+static inline t_count counter_clock(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (t_count)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+#define COUNT(field)            (counters.field++)
+#define COUNT_HIST(field, v)    (counters.field[counter_bin(v)]++)
+#define COUNT_START(name)       t_count name = counter_clock()
+#define COUNT_CYCLES(field, name) do { \
+        t_count _c = counter_clock() - name; \
+        counters.field##_calls++; \
+        counters.field##_cycles += _c; \
+        counters.field##_hist[counter_bin(_c)]++; \
+    } while (0)
+#define COUNTERS_FOLD()         counters_fold()
+#define COUNTERS_PRINT()        counters_print(stdout)
+
+#else
+
+#define COUNT(field)            ((void)0)
+#define COUNT_HIST(field, v)    ((void)0)
+#define COUNT_START(name)       ((void)0)
+#define COUNT_CYCLES(field, name) ((void)0)
+#define COUNTERS_FOLD()         ((void)0)
+#define COUNTERS_PRINT()        ((void)0)
+
+#endif
+
+#endif
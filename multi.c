@@ -0,0 +1,391 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "plinkolib.h"
+#include "multi.h"
+
+//============================================================================
+// calendar queue: bucket slot % nbuckets holds the events of every 'year'
+// whose time falls in [slot*width, (slot+1)*width), sorted by time.  Pops
+// go through the buckets in slot order, taking the head of a bucket only if
+// it belongs to the slot being looked at
+//============================================================================
+#define CALENDAR_MIN 16
+
+static void calendar_init(t_calendar *q){
+    q->events = NULL;
+    q->maxevents = 0;
+    q->free = -1;
+    q->size = 0;
+    q->nbuckets = CALENDAR_MIN;
+    q->bucket = malloc(sizeof(int)*q->nbuckets);
+    for (int b=0; b<q->nbuckets; b++) q->bucket[b] = -1;
+    q->width = 1.0;
+    q->slot = 0;
+}
+
+static void calendar_insert(t_calendar *q, int e){
+    t_mevent *ev = &q->events[e];
+    ev->slot = (long)floor(ev->t / q->width);
+
+    // after any others at the same time, so ties come out in push order
+    int *link = &q->bucket[ev->slot & (q->nbuckets-1)];
+    while (*link >= 0 && q->events[*link].t <= ev->t)
+        link = &q->events[*link].next;
+    ev->next = *link;
+    *link = e;
+}
+
+static int compare_times(const void *a, const void *b){
+    double ta = *(const double*)a, tb = *(const double*)b;
+    return (ta > tb) - (ta < tb);
+}
+
+static void calendar_resize(t_calendar *q, int nbuckets, double now){
+    int e, n = 0, *all = malloc(sizeof(int)*(q->size+1));
+    double *times = malloc(sizeof(double)*(q->size+1));
+
+    for (int b=0; b<q->nbuckets; b++)
+        for (e=q->bucket[b]; e>=0; e=q->events[e].next){
+            times[n] = q->events[e].t;
+            all[n++] = e;
+        }
+
+    // a few events to a bucket at the rate of the earlier half of them,
+    // since the far ones are mostly out of date long before they come up
+    qsort(times, n, sizeof(double), compare_times);
+    if (n > 1 && times[n/2] > times[0])
+        q->width = 3*(times[n/2] - times[0]) / (n/2);
+    free(times);
+
+    q->nbuckets = nbuckets;
+    q->bucket = realloc(q->bucket, sizeof(int)*nbuckets);
+    for (int b=0; b<nbuckets; b++) q->bucket[b] = -1;
+    for (int k=0; k<n; k++)
+        calendar_insert(q, all[k]);
+    q->slot = (long)floor(now / q->width);
+    free(all);
+}
+
+static void calendar_push(t_calendar *q, t_mevent *ev, double now){
+    if (q->free < 0){
+        int old = q->maxevents;
+        q->maxevents = MAX(2*old, 1024);
+        q->events = realloc(q->events, sizeof(t_mevent)*q->maxevents);
+        for (int e=old; e<q->maxevents; e++)
+            q->events[e].next = e+1 < q->maxevents ? e+1 : -1;
+        q->free = old;
+    }
+
+    int e = q->free;
+    q->free = q->events[e].next;
+    q->events[e] = *ev;
+    calendar_insert(q, e);
+
+    if (++q->size > 2*q->nbuckets)
+        calendar_resize(q, 2*q->nbuckets, now);
+}
+
+static int calendar_pop(t_calendar *q, t_mevent *out){
+    int b, e, mask = q->nbuckets-1;
+
+    if (q->size == 0) return 0;
+    while (1){
+        for (int k=0; k<q->nbuckets; k++, q->slot++){
+            e = q->bucket[q->slot & mask];
+            if (e >= 0 && q->events[e].slot <= q->slot)
+                goto found;
+        }
+
+        // a whole year with nothing in it, go straight to the earliest
+        e = -1;
+        for (b=0; b<q->nbuckets; b++)
+            if (q->bucket[b] >= 0 && (e < 0 || q->events[q->bucket[b]].t < q->events[e].t))
+                e = q->bucket[b];
+        q->slot = q->events[e].slot;
+    }
+
+found:
+    *out = q->events[e];
+    q->bucket[q->slot & mask] = out->next;
+    q->events[e].next = q->free;
+    q->free = e;
+
+    if (--q->size < q->nbuckets/2 && q->nbuckets > CALENDAR_MIN)
+        calendar_resize(q, q->nbuckets/2, out->t);
+    return 1;
+}
+
+static void calendar_free(t_calendar *q){
+    free(q->events);
+    free(q->bucket);
+}
+
+//============================================================================
+// the cell list of balls, with the walk of each ball's center clamped to it
+//============================================================================
+static int ball_cell(t_multi *m, t_walk *walk){
+    int ix = MIN(MAX(walk->ix, 0), m->cells.nx-1);
+    int iy = MIN(MAX(walk->iy, 0), m->cells.ny-1);
+    return iy*m->cells.nx + ix;
+}
+
+static void cell_add(t_multi *m, int i, int c){
+    m->balls[i].cell = c;
+    m->prev[i] = -1;
+    m->next[i] = m->head[c];
+    if (m->head[c] >= 0) m->prev[m->head[c]] = i;
+    m->head[c] = i;
+}
+
+static void cell_remove(t_multi *m, int i){
+    int c = m->balls[i].cell;
+    if (m->prev[i] >= 0) m->next[m->prev[i]] = m->next[i];
+    else m->head[c] = m->next[i];
+    if (m->next[i] >= 0) m->prev[m->next[i]] = m->prev[i];
+}
+
+// where ball i is at time t, without moving it there
+static void ball_at(t_ball *b, double t, double *pos, double *vel){
+    position(b->pos, b->vel, t - b->t, pos);
+    velocity(b->vel, t - b->t, vel);
+}
+
+static void ball_move(t_ball *b, double t){
+    ball_at(b, t, b->pos, b->vel);
+    b->t = t;
+}
+
+//============================================================================
+// prediction of the next events of a ball from its state at m->now
+//============================================================================
+static void predict_pair(t_multi *m, int i, int j){
+    t_ball *a = &m->balls[i], *b = &m->balls[j];
+    double pa[2], va[2], pb[2], vb[2], d[2], dv[2];
+
+    ball_at(a, m->now, pa, va);
+    ball_at(b, m->now, pb, vb);
+    d[0] = pa[0] - pb[0];  d[1] = pa[1] - pb[1];
+    dv[0] = va[0] - vb[0]; dv[1] = va[1] - vb[1];
+
+    // |d + dv t| = D, only while closing in
+    double bb = dot(d, dv);
+    double dv2 = dot(dv, dv);
+    double c = dot(d, d) - m->D*m->D;
+    double desc = bb*bb - dv2*c;
+    if (bb >= 0 || desc < 0) return;
+
+    // one of them bounces first and looks again then
+    t_mevent ev = {0};
+    ev.t = m->now + MAX((-bb - sqrt(desc)) / dv2, 0);
+    if (ev.t > MIN(a->tbounce, b->tbounce)) return;
+    ev.type = MULTI_PAIR;
+    ev.i = i;  ev.si = a->stamp;
+    ev.j = j;  ev.sj = b->stamp;
+    calendar_push(&m->queue, &ev, m->now);
+}
+
+// every ball in the cells next to c that were not next to cold
+static void predict_pairs(t_multi *m, int i, int c, int cold){
+    int nx = m->cells.nx, ny = m->cells.ny;
+    int cx = c % nx, cy = c / nx;
+    int ox = cold % nx, oy = cold / nx;
+
+    for (int y=MAX(cy-1, 0); y<=MIN(cy+1, ny-1); y++){
+        for (int x=MAX(cx-1, 0); x<=MIN(cx+1, nx-1); x++){
+            if (cold >= 0 && abs(x - ox) <= 1 && abs(y - oy) <= 1) continue;
+            for (int j=m->head[y*nx + x]; j>=0; j=m->next[j])
+                if (j != i) predict_pair(m, i, j);
+        }
+    }
+}
+
+static void predict_cross(t_multi *m, int i){
+    t_ball *b = &m->balls[i];
+    walk_cell(&b->walk, b->pos, b->vel, &m->cells);
+
+    t_mevent ev = {0};
+    ev.t = MAX(b->t + b->walk.tnext, m->now);
+    ev.type = MULTI_CROSS;
+    ev.i = i;  ev.si = b->stamp;
+    calendar_push(&m->queue, &ev, m->now);
+}
+
+// after ball i's velocity changed, everything it was going to do is off
+static void predict(t_multi *m, int i){
+    t_ball *b = &m->balls[i];
+    t_mevent ev = {0};
+
+    b->stamp++;
+    b->tbounce = INFINITY;
+    ev.result = next_collision(b->pos, b->vel, m->R, m->grid, m->wall, &ev.dt, ev.peg);
+    if (ev.result != RESULT_NOTHING){
+        ev.t = b->tbounce = b->t + ev.dt;
+        ev.type = MULTI_BOUNCE;
+        ev.i = i;  ev.si = b->stamp;
+        calendar_push(&m->queue, &ev, m->now);
+    }
+
+    // the walk restarts from where the ball is now
+    walk_start(&b->walk, b->pos, &m->cells);
+    int c = ball_cell(m, &b->walk);
+    if (c != b->cell){
+        cell_remove(m, i);
+        cell_add(m, i, c);
+    }
+    predict_cross(m, i);
+    predict_pairs(m, i, c, -1);
+}
+
+static void finish(t_multi *m, int i){
+    t_ball *b = &m->balls[i];
+    b->done = 1;
+    b->stamp++;
+    cell_remove(m, i);
+}
+
+//============================================================================
+// the events themselves
+//============================================================================
+static void do_bounce(t_multi *m, t_mevent *ev){
+    t_ball *b = &m->balls[ev->i];
+
+    m->stats.nbounces++;
+    if (!apply_event(b->pos, b->vel, m->damp, ev->result, ev->dt, ev->peg)){
+        if (ev->result == RESULT_DONE) b->res.xfinal = b->pos[0];
+        b->t = ev->t;
+        finish(m, ev->i);
+        return;
+    }
+
+    // apply_event leaves the ball EPS past the bounce
+    b->t = ev->t + EPS;
+    if (++b->res.nbounces >= MAXBOUNCES)
+        finish(m, ev->i);
+    else
+        predict(m, ev->i);
+}
+
+static void do_pair(t_multi *m, t_mevent *ev){
+    t_ball *a = &m->balls[ev->i], *b = &m->balls[ev->j];
+    double norm[2], dvn, damp;
+
+    m->stats.npairs++;
+    ball_move(a, ev->t);
+    ball_move(b, ev->t);
+
+    // equal masses swap the part of their velocities along the normal
+    create_norm(b->pos, a->pos, norm);
+    dvn = (a->vel[0] - b->vel[0])*norm[0] + (a->vel[1] - b->vel[1])*norm[1];
+    damp = m->damp;
+    if (ev->t - a->tcontact < MULTI_TC || ev->t - b->tcontact < MULTI_TC)
+        damp = 1;
+    for (int k=0; k<2; k++){
+        a->vel[k] = damp*(a->vel[k] - dvn*norm[k]);
+        b->vel[k] = damp*(b->vel[k] + dvn*norm[k]);
+    }
+    a->tcontact = b->tcontact = ev->t;
+
+    // as apply_event, a ball that has come to rest is done
+    int ids[2] = {ev->i, ev->j};
+    for (int k=0; k<2; k++){
+        t_ball *c = &m->balls[ids[k]];
+        if (++c->res.nbounces >= MAXBOUNCES || dot(c->vel, c->vel) < EPS)
+            finish(m, ids[k]);
+        else
+            predict(m, ids[k]);
+    }
+}
+
+static void do_cross(t_multi *m, t_mevent *ev){
+    t_ball *b = &m->balls[ev->i];
+
+    m->stats.ncrossings++;
+    walk_advance(&b->walk, b->vel, &m->cells);
+    int c = ball_cell(m, &b->walk);
+    if (c != b->cell){
+        int cold = b->cell;
+        cell_remove(m, ev->i);
+        cell_add(m, ev->i, c);
+        predict_pairs(m, ev->i, c, cold);
+    }
+    predict_cross(m, ev->i);
+}
+
+//============================================================================
+// external interface
+//============================================================================
+void multi_init(t_multi *m, int nballs, double *pos, double *vel,
+        double R, double D, double wall, double damp, t_grid *grid){
+    double ymax = 0;
+
+    memset(m, 0, sizeof(t_multi));
+    m->nballs = nballs;
+    m->balls = calloc(nballs, sizeof(t_ball));
+    m->R = R;
+    m->D = D;
+    m->wall = wall;
+    m->damp = damp;
+    m->grid = grid;
+
+    // as small as a ball allows, which keeps the pairs tested fewer than
+    // bigger cells crossed less often would, and a whole number of them
+    // between the walls
+    for (int i=0; i<nballs; i++)
+        ymax = MAX(ymax, pos[2*i+1]);
+    m->cells.nx = MAX((int)MIN(wall / D, 1024), 1);
+    m->cells.cell = wall / m->cells.nx;
+    m->cells.ny = (int)(ymax / m->cells.cell) + 1;
+    m->cells.x0 = m->cells.y0 = 0;
+
+    int ncells = m->cells.nx*m->cells.ny;
+    m->head = malloc(sizeof(int)*ncells);
+    m->next = malloc(sizeof(int)*nballs);
+    m->prev = malloc(sizeof(int)*nballs);
+    for (int c=0; c<ncells; c++) m->head[c] = -1;
+
+    calendar_init(&m->queue);
+
+    // each ball only looks for those already in, so every pair once
+    for (int i=0; i<nballs; i++){
+        t_ball *b = &m->balls[i];
+        memcpy(b->pos, &pos[2*i], sizeof(double)*2);
+        memcpy(b->vel, &vel[2*i], sizeof(double)*2);
+        b->res.xfinal = NAN;
+        b->tcontact = -INFINITY;
+
+        walk_start(&b->walk, b->pos, &m->cells);
+        cell_add(m, i, ball_cell(m, &b->walk));
+        predict(m, i);
+    }
+}
+
+long multi_run(t_multi *m){
+    t_mevent ev;
+
+    while (calendar_pop(&m->queue, &ev)){
+        m->stats.nevents++;
+        if (m->balls[ev.i].stamp != ev.si ||
+                (ev.type == MULTI_PAIR && m->balls[ev.j].stamp != ev.sj)){
+            m->stats.nstale++;
+            continue;
+        }
+
+        m->now = ev.t;
+        if (ev.type == MULTI_BOUNCE) do_bounce(m, &ev);
+        if (ev.type == MULTI_PAIR)   do_pair(m, &ev);
+        if (ev.type == MULTI_CROSS)  do_cross(m, &ev);
+    }
+
+    for (int i=0; i<m->nballs; i++)
+        m->balls[i].res.time_total = m->balls[i].t;
+    return m->stats.nevents;
+}
+
+void multi_free(t_multi *m){
+    calendar_free(&m->queue);
+    free(m->balls);
+    free(m->head);
+    free(m->next);
+    free(m->prev);
+}
@@ -0,0 +1,107 @@
+#ifndef __MULTI_H__
+#define __MULTI_H__
+
+#include "plinkolib.h"
+
+/*
+ * Many balls on the board at once, bouncing off the pegs, the walls and
+ * each other.  Rather than stepping time, the run goes from one event to
+ * the next in time order:
+ *
+ *      MULTI_BOUNCE    a ball meets a peg, a wall or the floor, as found
+ *                      by next_collision and applied by apply_event
+ *      MULTI_PAIR      two balls come within D of each other
+ *      MULTI_CROSS     a ball's center moves into the next cell of the
+ *                      cell list of balls
+ *
+ * Between events every ball flies its own arc, and since gravity is the
+ * same for all of them two balls move in straight lines relative to each
+ * other, so their contact time is the root of a quadratic.  Only balls in
+ * neighbouring cells (which are at least D across) are tested against
+ * each other, each time one of them changes velocity or cell.
+ *
+ * Events wait in a calendar queue, a ring of buckets each one 'width' of
+ * time wide and kept sorted, resized as it grows and shrinks so that push
+ * and pop take about constant time.  Events are never taken out when they
+ * go out of date: each carries the stamps its balls had when it was
+ * predicted, and a ball's stamp is bumped whenever its velocity changes,
+ * so one that no longer applies is dropped when it comes up.
+ *
+ * A contact swaps the two balls' velocities along the line between them,
+ * then scales both by damp as a bounce off a peg does, and counts as a
+ * bounce for each.  A ball on its own follows exactly trackCollision's
+ * path and gets the same result.
+ *
+ * Balls packed together and losing energy on every contact would hit each
+ * other ever more often without end (inelastic collapse), so a contact
+ * within MULTI_TC of a ball's last one is elastic.
+ */
+#define MULTI_TC 1e-6
+
+#define MULTI_BOUNCE 0
+#define MULTI_PAIR   1
+#define MULTI_CROSS  2
+
+typedef struct {
+    double t, dt;       // when, and for a bounce how long after the ball's state
+    double peg[2];
+    int type, result;
+    int i, j;
+    unsigned int si, sj;
+    long slot;          // (long)(t / width), which bucket it is in
+    int next;
+} t_mevent;
+
+typedef struct {
+    t_mevent *events;
+    int maxevents, free, size;
+
+    int *bucket;
+    int nbuckets;
+    double width;
+    long slot;          // the bucket whose events come up next
+} t_calendar;
+
+/* a ball's state at time t, with its walk through the cells of balls.
+ * tbounce is when its next bounce off a peg, wall or floor is due, which
+ * nothing but a contact before then can take away */
+typedef struct {
+    double pos[2], vel[2], t;
+    double tbounce, tcontact;
+    unsigned int stamp;
+    int cell, done;
+    t_walk walk;
+    t_result res;
+} t_ball;
+
+typedef struct {
+    ullong nevents, nstale;
+    ullong nbounces, npairs, ncrossings;
+} t_multistats;
+
+typedef struct {
+    int nballs;
+    t_ball *balls;
+    double R, D, wall, damp;
+    t_grid *grid;
+
+    // cell list of the balls over a t_grid without pegs, the edge cells
+    // going on without end so every ball is always in one
+    t_grid cells;
+    int *head, *next, *prev;
+
+    t_calendar queue;
+    double now;
+    t_multistats stats;
+} t_multi;
+
+/* sets up nballs balls at pos (x, y pairs) with vel, of diameter D */
+void multi_init(t_multi *m, int nballs, double *pos, double *vel,
+        double R, double D, double wall, double damp, t_grid *grid);
+
+/* runs until every ball is done, returns the number of events */
+long multi_run(t_multi *m);
+
+void multi_free(t_multi *m);
+
+#endif
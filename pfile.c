@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pfile.h"
+
+#define PAGE_ROUND(x) (((x) + PFILE_PAGE-1) / PFILE_PAGE * PFILE_PAGE)
+
+static const char zeros[PFILE_PAGE];
+
+static int write_header(t_pfile *file){
+    return pwrite(file->fd, &file->header, sizeof(t_pfile_header), 0)
+        != sizeof(t_pfile_header);
+}
+
+static int check_header(t_pfile_header *header){
+    return memcmp(header->magic, PFILE_MAGIC, 8) || header->version != PFILE_VERSION;
+}
+
+ullong pfile_hash(t_pfile_header *h, double *pegs){
+    ullong hash = HASH_INIT;
+    hash = hash_bytes(hash, &h->content, sizeof(uint64_t));
+    hash = hash_bytes(hash, &h->radius, sizeof(double)*4);
+    hash = hash_bytes(hash, &h->seed, sizeof(uint64_t));
+    hash = hash_bytes(hash, &h->nparticles, sizeof(uint64_t)*2);
+    hash = hash_bytes(hash, &h->record_size, sizeof(uint64_t));
+    hash = hash_bytes(hash, pegs, sizeof(double)*2*h->npegs);
+    return hash;
+}
+
+t_pfile *pfile_create(const char *filename, t_pfile_header *header,
+        double *pegs, size_t bufsize){
+    t_pfile *file;
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return NULL;
+
+    memcpy(header->magic, PFILE_MAGIC, 8);
+    header->version = PFILE_VERSION;
+    header->hash = pfile_hash(header, pegs);
+    header->pegs_offset = PFILE_PAGE;
+    header->records_offset = PAGE_ROUND(PFILE_PAGE + sizeof(double)*2*header->npegs);
+    header->nrecords = 0;
+    header->index_offset = 0;
+
+    file = calloc(1, sizeof(t_pfile));
+    file->fd = fd;
+    file->header = *header;
+    file->records = stream_fdopen(fd, bufsize);
+    if (!file->records){
+        close(fd);
+        free(file);
+        return NULL;
+    }
+
+    // the header is written over again by pfile_sync and pfile_close
+    stream_write(file->records, header, sizeof(t_pfile_header));
+    stream_write(file->records, zeros, PFILE_PAGE - sizeof(t_pfile_header));
+    stream_write(file->records, pegs, sizeof(double)*2*header->npegs);
+    stream_write(file->records, zeros, header->records_offset - stream_offset(file->records));
+    return file;
+}
+
+int pfile_read_header(const char *filename, t_pfile_header *header){
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 1;
+    int bad = read(fd, header, sizeof(t_pfile_header)) != sizeof(t_pfile_header);
+    close(fd);
+    return bad || check_header(header);
+}
+
+int pfile_read(const char *filename, uint64_t offset, void *buf, size_t count){
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 1;
+
+    char *p = buf;
+    ssize_t n = 1;
+    while (count && n > 0){
+        n = pread(fd, p, count, offset);
+        p += n > 0 ? n : 0;
+        offset += n > 0 ? n : 0;
+        count -= n > 0 ? n : 0;
+    }
+    close(fd);
+    return count != 0;
+}
+
+t_pfile *pfile_reopen(const char *filename, uint64_t nrecords, size_t bufsize){
+    t_pfile *file;
+    t_pfile_header header;
+    struct stat st;
+    off_t end;
+
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) return NULL;
+
+    end = 0;
+    if (read(fd, &header, sizeof(header)) == sizeof(header) && !check_header(&header)
+            && header.record_size > 0 && fstat(fd, &st) == 0)
+        end = header.records_offset + nrecords*header.record_size;
+    if (end == 0 || st.st_size < end || ftruncate(fd, end) || lseek(fd, end, SEEK_SET) != end){
+        close(fd);
+        return NULL;
+    }
+
+    file = calloc(1, sizeof(t_pfile));
+    file->fd = fd;
+    file->header = header;
+    file->header.nrecords = nrecords;
+    file->records = stream_fdopen(fd, bufsize);
+    if (!file->records){
+        close(fd);
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+void pfile_write(t_pfile *file, const void *data, size_t n){
+    t_pfile_header *h = &file->header;
+
+    if (h->record_size){
+        stream_write(file->records, data, n*h->record_size);
+        h->nrecords += n;
+        return;
+    }
+
+    // offsets are into the records section, which the stream started at
+    if (h->nrecords + 2 > file->maxindex){
+        file->maxindex = MAX(2*file->maxindex, 1024);
+        file->index = realloc(file->index, sizeof(uint64_t)*file->maxindex);
+    }
+    file->index[h->nrecords++] = stream_offset(file->records) - h->records_offset;
+    stream_write(file->records, data, n);
+}
+
+int pfile_sync(t_pfile *file){
+    int error = stream_flush(file->records);
+    error |= write_header(file);
+    return error | fsync(file->fd);
+}
+
+int pfile_close(t_pfile *file){
+    t_pfile_header *h = &file->header;
+    int error;
+
+    if (!h->record_size){
+        if (!file->index)
+            file->index = malloc(sizeof(uint64_t));
+        file->index[h->nrecords] = stream_offset(file->records) - h->records_offset;
+
+        h->index_offset = PAGE_ROUND(stream_offset(file->records));
+        stream_write(file->records, zeros, h->index_offset - stream_offset(file->records));
+        stream_write(file->records, file->index, sizeof(uint64_t)*(h->nrecords+1));
+    }
+
+    error = stream_release(file->records);
+    error |= write_header(file);
+    if (close(file->fd)) error = 1;
+
+    free(file->index);
+    free(file);
+    return error;
+}
@@ -0,0 +1,99 @@
+#ifndef __PFILE_H__
+#define __PFILE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "plinkolib.h"
+#include "stream.h"
+
+/*
+ * One self describing file per run, <name>.plinko, in place of the old
+ * .conf / .pegs / .track trio.  Every section starts on a PFILE_PAGE
+ * boundary so each can be mapped on its own (np.memmap with its offset):
+ *
+ *      header      t_pfile_header, zero padded to one page
+ *      pegs        npegs (x, y) doubles
+ *      records     appended as the run goes
+ *      index       variable length records only: nrecords+1 uint64 byte
+ *                  offsets into the records section, the last one its end
+ *
+ * Records are either all record_size bytes, or (record_size 0) of any
+ * length, found through the index.  The index and the final nrecords are
+ * written by pfile_close; pfile_sync brings nrecords up to date before
+ * that, so fixed size records can be read while a run is still going.
+ * Everything is native endian.
+ */
+#define PFILE_MAGIC   "PLINKO\0\0"
+#define PFILE_VERSION 2
+#define PFILE_PAGE    4096
+
+// what the records hold
+#define PFILE_BOUNCES    1   // one double per particle, its bounce count
+#define PFILE_POINTS     2   // (x, y) points of one trajectory
+#define PFILE_TRACKS     3   // one variable length record of points per particle
+#define PFILE_HISTOGRAM  4   // counts over [0,wall]x[0,top], one record per row
+#define PFILE_EVENTS     5   // t_event log of one trajectory, one record per event
+#define PFILE_BASIN      6   // (x, y, depth, cup, nbounces) per initial condition
+#define PFILE_LYAPUNOV   7   // (x0, nbounces, time, log stretch) per particle
+#define PFILE_STRETCH    8   // (t, log stretch) after each event of one trajectory
+#define PFILE_SHADOW     9   // double against long double, one record per flagged particle
+
+typedef struct {
+    char magic[8];
+    uint64_t version, content;
+
+    // the run: board, drop height, particles and samples per particle
+    double radius, damp, wall, top;
+    uint64_t seed, hash;
+    uint64_t nparticles, timepoints;
+
+    // sections, as byte offsets from the start of the file
+    uint64_t npegs, pegs_offset;
+    uint64_t record_size, nrecords;
+    uint64_t records_offset, index_offset;
+
+    // a shard of a run split across processes (see sweep_shard) holds the
+    // particles from first on; nshards 0 is a whole run
+    uint64_t shard, nshards, first;
+} t_pfile_header;
+
+typedef struct {
+    int fd;
+    t_pfile_header header;
+    t_stream *records;
+
+    // offsets of variable length records, written out at the end
+    uint64_t *index;
+    size_t maxindex;
+} t_pfile;
+
+/* fingerprint of everything in the header that decides the results,
+ * which all shards of a run share */
+ullong pfile_hash(t_pfile_header *header, double *pegs);
+
+/* creates filename with the run described by header (its offsets, counts
+ * and hash are filled in) and the peg table, NULL if it can not */
+t_pfile *pfile_create(const char *filename, t_pfile_header *header,
+        double *pegs, size_t bufsize);
+
+/* reopens a file of fixed size records to append to it, dropping any past
+ * the first nrecords.  NULL if it can not be, or has fewer than that */
+t_pfile *pfile_reopen(const char *filename, uint64_t nrecords, size_t bufsize);
+
+/* reads the header of filename, nonzero if it is not a pfile */
+int pfile_read_header(const char *filename, t_pfile_header *header);
+
+/* reads count bytes at offset of filename into buf, nonzero if it can not */
+int pfile_read(const char *filename, uint64_t offset, void *buf, size_t count);
+
+/* appends n records of record_size bytes, or with variable length records
+ * one record of n bytes */
+void pfile_write(t_pfile *file, const void *data, size_t n);
+
+/* everything written so far is on disk and counted in the header */
+int pfile_sync(t_pfile *file);
+
+/* writes the index and final header and frees file, nonzero on an error */
+int pfile_close(t_pfile *file);
+
+#endif
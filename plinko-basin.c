@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "plinkolib.h"
+#include "sweep.h"
+#include "batch.h"
+#include "pfile.h"
+
+/*===========================================================================
+ *  Where each drop ends up, mapped over its initial conditions by
+ *  refining only where the outcome changes.  The domain is x0 alone (x),
+ *  x0 and vx0 (xv) or x0 and y0 (xy), on a lattice of 2^depth intervals a
+ *  side.  It starts from tiles 2^(depth-base) across.  A tile whose
+ *  corners (ends in 1D) all land in the same cup is done.  Any other tile
+ *  is split in four (two) for the next level, down to single intervals.
+ *  All corners new to a level go through the batch engine together.
+ *
+ *  Every initial condition evaluated goes to <filename>.plinko as it comes
+ *  in (x, y, depth, cup, nbounces), coarsest first, so the map can be
+ *  drawn at any point of the run.  In 2D, <filename>.pgm is redrawn after
+ *  every level, each tile shaded by the cup of its first corner.
+ *=========================================================================*/
+#define SEED 123123
+#define IMAGE_MAX 1024
+
+// x0 is moved off the dyadic points, or the middle one drops straight onto
+// a peg and bounces on it for MAXBOUNCES
+#define SHIFT 1.41421356e-9
+
+typedef struct {
+    long ix, iy;
+    int cup, nbounces, depth;
+} t_point;
+
+typedef struct {
+    long ix, iy, size;
+} t_tile;
+
+typedef struct {
+    double R, damp, wall, top;
+    t_grid *grid;
+    int mode, depth;
+    long n;                     // intervals a side at the finest level
+    double lo[2], hi[2];
+
+    t_point *points;
+    long npoints, maxpoints, first;
+
+    // (ix, iy) -> index in points, open addressing
+    long *keys, *slots;
+    long nslots;
+
+    t_pfile *file;
+} t_basin;
+
+enum { MODE_X, MODE_XV, MODE_XY };
+
+static void initial_condition(t_basin *b, t_point *p, double *pos, double *vel){
+    double u = b->lo[0] + (b->hi[0] - b->lo[0]) * p->ix / b->n;
+    double v = b->lo[1] + (b->hi[1] - b->lo[1]) * p->iy / b->n;
+    pos[0] = u;
+    pos[1] = b->mode == MODE_XY ? v : b->top;
+    vel[0] = b->mode == MODE_XV ? v : 0;
+    vel[1] = 1e-4;
+}
+
+static int cup(t_basin *b, t_result *res){
+    // unit wide cups along the floor, -1 for a flight that never got there
+    if (isnan(res->xfinal)) return -1;
+    return MIN(MAX((int)floor(res->xfinal), 0), (int)ceil(b->wall) - 1);
+}
+
+static long slot(t_basin *b, long key){
+    // where key is in the table, or the empty slot it would go in
+    long h = (key * 0x9E3779B97F4A7C15ULL) >> 20 & (b->nslots - 1);
+    while (b->keys[h] >= 0 && b->keys[h] != key)
+        h = (h + 1) & (b->nslots - 1);
+    return h;
+}
+
+static long point_index(t_basin *b, long ix, long iy, int depth){
+    // the point at (ix, iy), added to be evaluated if it is new
+    long key = ix*(b->n+1) + iy;
+    long h = slot(b, key);
+    if (b->keys[h] == key) return b->slots[h];
+
+    if (b->npoints == b->maxpoints){
+        b->maxpoints *= 2;
+        b->points = realloc(b->points, sizeof(t_point)*b->maxpoints);
+    }
+    t_point p = { ix, iy, -1, 0, depth };
+    b->points[b->npoints] = p;
+    b->keys[h] = key;
+    b->slots[h] = b->npoints;
+    return b->npoints++;
+}
+
+static void grow_table(t_basin *b){
+    // kept under half full
+    if (2*b->npoints < b->nslots) return;
+    free(b->keys);
+    free(b->slots);
+    b->nslots *= 4;
+    b->keys = malloc(sizeof(long)*b->nslots);
+    b->slots = malloc(sizeof(long)*b->nslots);
+    memset(b->keys, -1, sizeof(long)*b->nslots);
+
+    for (long i=0; i<b->npoints; i++){
+        long key = b->points[i].ix*(b->n+1) + b->points[i].iy;
+        long h = slot(b, key);
+        b->keys[h] = key;
+        b->slots[h] = i;
+    }
+}
+
+//============================================================================
+// a level's new points through the batch engine, committed in order
+//============================================================================
+static int next(void *ctx, int wait, long *i, double *pos, double *vel){
+    t_sweep *sweep = ctx;
+    t_basin *b = sweep->ctx;
+    int got = sweep_next(sweep, i, wait);
+    if (got == 1)
+        initial_condition(b, &b->points[b->first + *i], pos, vel);
+    return got;
+}
+
+static void done(void *ctx, long i, t_result *res){
+    t_sweep *sweep = ctx;
+    t_basin *b = sweep->ctx;
+    b->points[b->first + i].cup = cup(b, res);
+    b->points[b->first + i].nbounces = res->nbounces;
+    sweep_done(sweep, i);
+}
+
+static void batch(t_sweep *sweep, void *ctx){
+    t_basin *b = ctx;
+    trackCollisionBatch(b->R, b->wall, b->damp, b->grid, next, done, sweep);
+}
+
+static int commit(long i, int slot, void *ctx){
+    t_basin *b = ctx;
+    t_point *p = &b->points[b->first + i];
+    double pos[2], vel[2];
+    (void)slot;
+
+    initial_condition(b, p, pos, vel);
+    double record[5] = { pos[0], b->mode == MODE_XY ? pos[1] : vel[0],
+        p->depth, p->cup, p->nbounces };
+    pfile_write(b->file, record, 1);
+    return 0;
+}
+
+//============================================================================
+// the image, redrawn from the tiles of every level so far
+//============================================================================
+static void paint(t_basin *b, unsigned char *image, long m, t_tile *t, int c, int ncups){
+    long x0 = t->ix*m / b->n, x1 = MAX((t->ix + t->size)*m / b->n, x0 + 1);
+    long y0 = t->iy*m / b->n, y1 = MAX((t->iy + t->size)*m / b->n, y0 + 1);
+    unsigned char shade = c < 0 ? 0 : 32 + 223*c / MAX(ncups - 1, 1);
+
+    for (long y=y0; y<MIN(y1, m); y++)
+        for (long x=x0; x<MIN(x1, m); x++)
+            image[(m - 1 - y)*m + x] = shade;
+}
+
+static int write_image(const char *filename, unsigned char *image, long m){
+    FILE *file = fopen(filename, "wb");
+    if (!file) return 1;
+    fprintf(file, "P5\n%li %li\n255\n", m, m);
+    fwrite(image, 1, m*m, file);
+    return fclose(file);
+}
+
+int main(int argc, char **argv){
+    const char *modes[] = {"x", "xv", "xy"};
+    int mode = -1;
+    for (int k=0; argc > 2 && k<3; k++)
+        if (strcmp(argv[2], modes[k]) == 0) mode = k;
+
+    if (argc < 3 || argc > 5 || mode < 0){
+        printf("Incorrect arguments supplied, must be <filename> <x|xv|xy> [depth] [base]\n");
+        return 1;
+    }
+
+    double R = 0.75/2;
+    double damp = 1.0;
+    double wall = 7;
+    double top = 10.0;
+
+    int dim = mode == MODE_X ? 1 : 2;
+    int DEPTH = argc > 3 ? atoi(argv[3]) : (dim == 1 ? 20 : 10);
+    int BASE = argc > 4 ? atoi(argv[4]) : (dim == 1 ? 8 : 4);
+    if (DEPTH < 1 || DEPTH > 30 || BASE < 0 || BASE > DEPTH){
+        printf("depth must be in 1..30 and base in 0..depth\n");
+        return 1;
+    }
+
+    char file_track[1024], file_image[1024];
+    sprintf(file_track, "%s.plinko", argv[1]);
+    sprintf(file_image, "%s.pgm", argv[1]);
+
+    t_grid grid;
+    build_lattice_grid(&grid, LATTICE_HEX, 4, 8, 0, R);
+    int npegs = grid.npegs;
+    double *pegs = lattice_pegs(&grid);
+
+    // x0 over plinko's drops, and around them in vx0 or y0
+    t_basin b = { R, damp, wall, top, &grid, mode, DEPTH, 1L << DEPTH,
+        {wall/2 - 0.5 + SHIFT, mode == MODE_XV ? -0.1 : top - 0.5},
+        {wall/2 + 0.5 + SHIFT, mode == MODE_XV ? 0.1 : top + 0.5},
+        malloc(sizeof(t_point)*1024), 0, 1024, 0, NULL, NULL, 1 << 12, NULL };
+    b.keys = malloc(sizeof(long)*b.nslots);
+    b.slots = malloc(sizeof(long)*b.nslots);
+    memset(b.keys, -1, sizeof(long)*b.nslots);
+
+    // one record per initial condition: (x0, vx0 or y0, depth, cup, nbounces)
+    t_pfile_header header = { "", 0, PFILE_BASIN, R, damp, wall, top, SEED, 0,
+        0, 0, npegs, 0, 5*sizeof(double), 0, 0, 0, 0, 0, 0 };
+    b.file = pfile_create(file_track, &header, pegs, 1 << 16);
+    if (!b.file){
+        printf("Could not open %s for writing\n", file_track);
+        return 1;
+    }
+
+    long m = MIN(b.n, IMAGE_MAX);
+    unsigned char *image = dim == 2 ? calloc(m*m, 1) : NULL;
+    int ncups = (int)ceil(wall);
+
+    // the tiles of the base level cover the whole domain
+    long size = 1L << (DEPTH - BASE), across = 1L << BASE;
+    long ntiles = dim == 2 ? across*across : across;
+    t_tile *tiles = malloc(sizeof(t_tile)*ntiles);
+    for (long k=0; k<ntiles; k++){
+        t_tile t = { (k % across)*size, dim == 2 ? (k / across)*size : 0, size };
+        tiles[k] = t;
+    }
+
+    long nleaves = 0;
+    printf("%6s %10s %10s %10s %10s\n", "depth", "tiles", "evaluated", "split", "total");
+    for (int depth=BASE; ntiles; depth++){
+        // the corners not seen yet, all of them evaluated together
+        b.first = b.npoints;
+        for (long k=0; k<ntiles; k++){
+            t_tile *t = &tiles[k];
+            for (int c=0; c<(dim == 2 ? 4 : 2); c++){
+                point_index(&b, t->ix + (c & 1)*t->size, t->iy + (c >> 1)*t->size, depth);
+                grow_table(&b);
+            }
+        }
+
+        long nnew = b.npoints - b.first;
+        if (nnew){
+            t_sweep sweep = { 0, nnew, (int)MIN(nnew, 1 << 20), NULL, commit, &b, batch, NULL };
+            sweep_run(&sweep);
+        }
+
+        // split the tiles whose corners disagree
+        t_tile *children = malloc(sizeof(t_tile)*ntiles*(dim == 2 ? 4 : 2));
+        long nchildren = 0;
+        for (long k=0; k<ntiles; k++){
+            t_tile *t = &tiles[k];
+            int cups[4], differ = 0;
+            for (int c=0; c<(dim == 2 ? 4 : 2); c++){
+                long p = point_index(&b, t->ix + (c & 1)*t->size, t->iy + (c >> 1)*t->size, depth);
+                cups[c] = b.points[p].cup;
+                differ |= cups[c] != cups[0];
+            }
+            if (image) paint(&b, image, m, t, cups[0], ncups);
+
+            if (!differ || t->size == 1){
+                nleaves++;
+                continue;
+            }
+            long h = t->size / 2;
+            for (int c=0; c<(dim == 2 ? 4 : 2); c++){
+                t_tile child = { t->ix + (c & 1)*h, t->iy + (c >> 1)*h, h };
+                children[nchildren++] = child;
+            }
+        }
+
+        printf("%6i %10li %10li %10li %10li\n", depth, ntiles, nnew,
+            nchildren / (dim == 2 ? 4 : 2), b.npoints);
+        if (image && write_image(file_image, image, m))
+            printf("Could not write %s\n", file_image);
+        pfile_sync(b.file);
+
+        free(tiles);
+        tiles = children;
+        ntiles = nchildren;
+    }
+
+    double full = dim == 2 ? (double)(b.n+1)*(b.n+1) : (double)(b.n+1);
+    printf("%li trajectories, %.3g%% of the %.4g of a uniform 2^%i grid, %li leaves\n",
+        b.npoints, 100*b.npoints / full, full, DEPTH, nleaves);
+
+    if (pfile_close(b.file))
+        printf("Error writing %s\n", file_track);
+
+    free(tiles);
+    free(image);
+    free(b.points);
+    free(b.keys);
+    free(b.slots);
+    free_peg_grid(&grid);
+    free(pegs);
+    return 0;
+}
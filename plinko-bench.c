@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "plinkolib.h"
+#include "sweep.h"
+#include "batch.h"
+#include "pfile.h"
+
+/*===========================================================================
+ *  End to end benchmark: a fixed set of fixed-seed scenarios, each run in a
+ *  child process of its own so its peak RSS is its own, timed from the
+ *  first drop to its output file being closed.  Each is run repeats times
+ *  (5 by default) and its fastest run kept: whatever else the machine is
+ *  doing only ever slows a run down, so the best is the steadiest figure.
+ *  The repeats go round all the scenarios in turn, so that a slow spell
+ *  of the machine does not fall on every run of one of them.  For each it
+ *  reports events/s (bounces), particles/s, peak RSS and the bytes
+ *  written, all into <out.json>.  Given a baseline written by an earlier
+ *  run on the same machine (make bench-baseline), any scenario whose
+ *  events/s fell by more than threshold (a fraction, 0.1 by default) is a
+ *  regression and the exit code is 1.
+ *=========================================================================*/
+#define SEED 123123
+#define WINDOW (1 << 14)
+#define MAXSCENARIOS 16
+
+#define BENCH_BOUNCES 1     // batch engine, one bounce count per particle
+#define BENCH_DENSITY 2     // sampled trajectories binned into a histogram
+
+typedef struct {
+    const char *name;
+    int kind;
+    int lattice, rows, cols;
+    double R, damp, wall, top;
+    long nparticles;
+} t_scenario;
+
+static t_scenario scenarios[] = {
+    {"drops",   BENCH_BOUNCES, LATTICE_HEX, 4,  8,  0.375, 0.5, 7,  10.0, 400000},
+    {"chaotic", BENCH_BOUNCES, LATTICE_HEX, 4,  8,  0.375, 1.0, 7,  10.0, 40000},
+    {"wide",    BENCH_BOUNCES, LATTICE_HEX, 8,  64, 0.375, 0.9, 63, 18.0, 20000},
+    {"density", BENCH_DENSITY, LATTICE_HEX, 4,  16, 0.375, 0.9, 14, 7.0,  20000},
+};
+
+typedef struct {
+    long nparticles;
+    ullong nevents;
+    double secs;
+    long maxrss, bytes;
+} t_measure;
+
+typedef struct {
+    t_scenario *s;
+    t_grid *grid;
+    t_pfile *file;
+    double *bounces;
+    ullong nevents;
+
+    // density only, the histogram is nx by ny over [0,wall]x[0,top]
+    int nx, ny, nlocals;
+    double **locals;
+} t_run;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void initial_condition(t_scenario *s, long i, double *pos, double *vel){
+    t_rng rng;
+    rng_seed(&rng, SEED, i);
+    pos[0] = s->wall/2 - 0.5 + rng_ran2(&rng);
+    pos[1] = s->top;
+    vel[0] = 0;
+    vel[1] = 1e-4;
+}
+
+//============================================================================
+// bounce counts through the batch engine, as plinko runs them
+//============================================================================
+static int next(void *ctx, int wait, long *i, double *pos, double *vel){
+    t_sweep *sweep = ctx;
+    t_run *r = sweep->ctx;
+    int got = sweep_next(sweep, i, wait);
+    if (got == 1)
+        initial_condition(r->s, *i, pos, vel);
+    return got;
+}
+
+static void done(void *ctx, long i, t_result *res){
+    t_sweep *sweep = ctx;
+    t_run *r = sweep->ctx;
+    r->bounces[i % WINDOW] = res->nbounces;
+    sweep_done(sweep, i);
+}
+
+static void batch(t_sweep *sweep, void *ctx){
+    t_run *r = ctx;
+    t_scenario *s = r->s;
+    trackCollisionBatch(s->R, s->wall, s->damp, r->grid, next, done, sweep);
+}
+
+static int commit_bounces(long i, int slot, void *ctx){
+    t_run *r = ctx;
+    (void)i;
+    pfile_write(r->file, &r->bounces[slot], 1);
+    r->nevents += r->bounces[slot];
+    return 0;
+}
+
+//============================================================================
+// density, as plinko-density runs it: every thread bins into its own copy
+//============================================================================
+typedef struct {
+    t_sink sink;
+    t_run *r;
+    double *counts;
+} t_local;
+
+static t_local local;
+#pragma omp threadprivate(local)
+
+static int bin_points(t_sink *sink){
+    t_local *l = sink->ctx;
+    t_run *r = l->r;
+    double *pt = (double*)sink->buf;
+    int k, ix, iy;
+
+    for (k=0; k<sink->n; k++){
+        ix = (int)floor(pt[2*k+0] / r->s->wall * r->nx);
+        iy = (int)floor(pt[2*k+1] / r->s->top * r->ny);
+        if (ix < 0 || ix >= r->nx || iy < 0 || iy >= r->ny) continue;
+        l->counts[(long)iy*r->nx + ix] += 1;
+    }
+
+    // the whole flight, as plinko-density bins it
+    sink->n = 0;
+    return 1;
+}
+
+static void work_density(long i, int slot, void *ctx){
+    t_run *r = ctx;
+    t_scenario *s = r->s;
+    double pos[2], vel[2];
+    t_result res;
+
+    if (!local.counts){
+        t_sink sink = { NULL, 2*sizeof(double), 1 << 10, 0, bin_points, NULL, &local };
+        sink.buf = malloc(sink.record*sink.size);
+        local.sink = sink;
+        local.r = r;
+        local.counts = calloc((size_t)r->nx*r->ny, sizeof(double));
+        #pragma omp critical(bench_locals)
+        {
+            r->locals = realloc(r->locals, sizeof(double*)*(r->nlocals+1));
+            r->locals[r->nlocals++] = local.counts;
+        }
+    }
+
+    initial_condition(s, i, pos, vel);
+    trackTrajectory(pos, vel, s->R, s->wall, s->damp, r->grid, &res, &local.sink, 1, 0.10);
+    r->bounces[slot] = res.nbounces;
+}
+
+static int commit_density(long i, int slot, void *ctx){
+    t_run *r = ctx;
+    (void)i;
+    r->nevents += r->bounces[slot];
+    return 0;
+}
+
+//============================================================================
+// one scenario, start to finish, in the calling (child) process
+//============================================================================
+static int run_scenario(t_scenario *s, t_measure *m){
+    char file_track[1024];
+    struct stat st;
+    struct rusage ru;
+    t_grid grid;
+
+    sprintf(file_track, "bench-%s.plinko", s->name);
+    build_lattice_grid(&grid, s->lattice, s->rows, s->cols, 0, s->R);
+
+    int npegs = grid.npegs;
+    double *pegs = lattice_pegs(&grid);
+
+    t_run r = { s, &grid, NULL, malloc(sizeof(double)*WINDOW), 0, 500, 0, 0, NULL };
+    r.ny = MAX((int)(r.nx * s->top / s->wall), 1);
+
+    int content = s->kind == BENCH_DENSITY ? PFILE_HISTOGRAM : PFILE_BOUNCES;
+    size_t record = s->kind == BENCH_DENSITY ? sizeof(double)*r.nx : sizeof(double);
+    t_pfile_header header = { "", 0, content, s->R, s->damp, s->wall, s->top, SEED, 0,
+        s->nparticles, 0, npegs, 0, record, 0, 0, 0, 0, 0, 0 };
+
+    double start = now();
+    r.file = pfile_create(file_track, &header, pegs, 1 << 16);
+    if (!r.file){
+        printf("Could not open %s for writing\n", file_track);
+        return 1;
+    }
+
+    if (s->kind == BENCH_DENSITY){
+        t_sweep sweep = { 0, s->nparticles, WINDOW, work_density, commit_density, &r, NULL, NULL };
+        sweep_run(&sweep);
+
+        double *counts = calloc((size_t)r.nx*r.ny, sizeof(double));
+        for (int t=0; t<r.nlocals; t++)
+            for (long k=0; k<(long)r.nx*r.ny; k++)
+                counts[k] += r.locals[t][k];
+        pfile_write(r.file, counts, r.ny);
+        free(counts);
+    } else {
+        t_sweep sweep = { 0, s->nparticles, WINDOW, NULL, commit_bounces, &r, batch, NULL };
+        sweep_run(&sweep);
+    }
+
+    int error = pfile_close(r.file);
+    m->secs = now() - start;
+    m->nparticles = s->nparticles;
+    m->nevents = r.nevents;
+    m->bytes = stat(file_track, &st) ? -1 : (long)st.st_size;
+    getrusage(RUSAGE_SELF, &ru);
+    m->maxrss = ru.ru_maxrss;
+    unlink(file_track);
+
+    free(r.bounces);
+    free(pegs);
+    free_peg_grid(&grid);
+    if (error) printf("Error writing %s\n", file_track);
+    return error;
+}
+
+static int measure(t_scenario *s, t_measure *m){
+    // a child per scenario, so that the peak RSS and the OpenMP threads
+    // are its own, sending back its t_measure
+    int fd[2], status;
+    if (pipe(fd)) return 1;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) return 1;
+    if (pid == 0){
+        close(fd[0]);
+        int error = run_scenario(s, m);
+        if (!error && write(fd[1], m, sizeof(t_measure)) != sizeof(t_measure))
+            error = 1;
+        close(fd[1]);
+        _exit(error);
+    }
+
+    close(fd[1]);
+    ssize_t n = read(fd[0], m, sizeof(t_measure));
+    close(fd[0]);
+    waitpid(pid, &status, 0);
+    return n != sizeof(t_measure) || !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+
+//============================================================================
+// JSON in and out, only as much of it as this file writes
+//============================================================================
+static void write_json(FILE *out, int n, t_measure *m){
+    fprintf(out, "{\n  \"seed\": %i,\n  \"scenarios\": [\n", SEED);
+    for (int k=0; k<n; k++){
+        fprintf(out, "    {\"name\": \"%s\", \"particles\": %li, \"events\": %llu, "
+            "\"seconds\": %.6f, \"events_per_s\": %.1f, \"particles_per_s\": %.1f, "
+            "\"peak_rss_kb\": %li, \"output_bytes\": %li}%s\n",
+            scenarios[k].name, m[k].nparticles, m[k].nevents, m[k].secs,
+            m[k].nevents / m[k].secs, m[k].nparticles / m[k].secs,
+            m[k].maxrss, m[k].bytes, k < n-1 ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static double baseline_rate(const char *json, const char *name){
+    // events_per_s of the entry named name, NAN if there is none
+    char key[256];
+    sprintf(key, "\"name\": \"%s\"", name);
+    const char *at = strstr(json, key);
+    if (!at) return NAN;
+    at = strstr(at, "\"events_per_s\":");
+    if (!at) return NAN;
+    return atof(at + strlen("\"events_per_s\":"));
+}
+
+static char *read_file(const char *filename){
+    FILE *file = fopen(filename, "r");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *buf = malloc(size + 1);
+    buf[fread(buf, 1, size, file)] = '\0';
+    fclose(file);
+    return buf;
+}
+
+int main(int argc, char **argv){
+    if (argc < 2 || argc > 5){
+        printf("Incorrect arguments supplied, must be <out.json> [baseline.json]\n");
+        printf("    [threshold] [repeats]\n");
+        return 1;
+    }
+    double threshold = argc > 3 ? atof(argv[3]) : 0.1;
+    int repeats = argc > 4 ? atoi(argv[4]) : 5;
+    if (repeats < 1){
+        printf("repeats must be at least 1\n");
+        return 1;
+    }
+
+    int n = sizeof(scenarios)/sizeof(scenarios[0]);
+    t_measure m[MAXSCENARIOS], run;
+
+    for (int r=0; r<repeats; r++){
+        for (int k=0; k<n; k++){
+            if (measure(&scenarios[k], &run)){
+                printf("Scenario %s failed\n", scenarios[k].name);
+                return 1;
+            }
+            if (r == 0 || run.secs < m[k].secs) m[k] = run;
+        }
+    }
+
+    printf("%-10s %10s %12s %14s %14s %12s %12s\n", "scenario", "particles",
+        "events", "events/s", "particles/s", "peak RSS kB", "bytes");
+    for (int k=0; k<n; k++){
+        printf("%-10s %10li %12llu %14.4g %14.4g %12li %12li\n", scenarios[k].name,
+            m[k].nparticles, m[k].nevents, m[k].nevents / m[k].secs,
+            m[k].nparticles / m[k].secs, m[k].maxrss, m[k].bytes);
+    }
+
+    FILE *out = fopen(argv[1], "w");
+    if (!out){
+        printf("Could not open %s for writing\n", argv[1]);
+        return 1;
+    }
+    write_json(out, n, m);
+    fclose(out);
+
+    // an empty baseline name writes out.json only, as make bench-baseline does
+    if (argc < 3 || !argv[2][0]) return 0;
+    char *json = read_file(argv[2]);
+    if (!json){
+        printf("No baseline %s, nothing to compare (make bench-baseline)\n", argv[2]);
+        return 0;
+    }
+
+    int regressed = 0;
+    for (int k=0; k<n; k++){
+        double base = baseline_rate(json, scenarios[k].name);
+        if (isnan(base) || base <= 0){
+            printf("%-10s not in the baseline\n", scenarios[k].name);
+            continue;
+        }
+        double change = (m[k].nevents / m[k].secs) / base - 1;
+        int bad = change < -threshold;
+        printf("%-10s %+6.1f%% events/s against the baseline%s\n", scenarios[k].name,
+            100*change, bad ? "  REGRESSION" : "");
+        regressed |= bad;
+    }
+    free(json);
+    return regressed;
+}
@@ -6,80 +6,164 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include "plinkolib.h"
+#include "sweep.h"
+#include "pfile.h"
+#include "counters.h"
+
+#define SEED 123123
+#define WINDOW (1 << 10)
+#define CHUNK (1 << 10)
+
+typedef struct {
+    double R, damp, wall, top;
+    t_grid *grid;
+    int nx, ny;
+
+    // the local histogram and sink buffer of every thread that has worked
+    int nlocals;
+    double **locals;
+    void **bufs;
+
+    int *nbounces;
+    t_progress progress;
+} t_density;
+
+/* every thread bins the points of its own particles into a histogram of
+ * its own, so nothing is shared until they are added up at the end.  Its
+ * sink bins them CHUNK at a time, so a flight runs to its end however
+ * many points it makes */
+typedef struct {
+    t_sink sink;
+    t_density *d;
+    double *counts;
+} t_local;
+
+static t_local local;
+#pragma omp threadprivate(local)
+
+static int bin_points(t_sink *sink){
+    t_local *l = sink->ctx;
+    t_density *d = l->d;
+    double *pt = (double*)sink->buf;
+    int k, ix, iy;
+
+    for (k=0; k<sink->n; k++){
+        ix = (int)floor(pt[2*k+0] / d->wall * d->nx);
+        iy = (int)floor(pt[2*k+1] / d->top * d->ny);
+        if (ix < 0 || ix >= d->nx || iy < 0 || iy >= d->ny) continue;
+        l->counts[(long)iy*d->nx + ix] += 1;
+    }
+
+    sink->n = 0;
+    return 1;
+}
+
+static void work(long i, int slot, void *ctx){
+    t_density *d = ctx;
+    t_rng rng;
+    t_result res;
+
+    if (!local.counts){
+        t_sink sink = { NULL, 2*sizeof(double), CHUNK, 0, bin_points, NULL, &local };
+        sink.buf = malloc(sink.record*sink.size);
+        local.sink = sink;
+        local.d = d;
+        local.counts = calloc((size_t)d->nx*d->ny, sizeof(double));
+        #pragma omp critical(density_locals)
+        {
+            d->locals = realloc(d->locals, sizeof(double*)*(d->nlocals+1));
+            d->bufs = realloc(d->bufs, sizeof(void*)*(d->nlocals+1));
+            d->locals[d->nlocals] = local.counts;
+            d->bufs[d->nlocals++] = local.sink.buf;
+        }
+    }
+
+    rng_seed(&rng, SEED, i);
+    double pos[2] = { d->wall/2 - 0.5 + rng_ran2(&rng), d->top };
+    double vel[2] = { 0.0, 1e-4 };
+
+    trackTrajectory(pos, vel, d->R, d->wall, d->damp,
+        d->grid, &res, &local.sink, 1, 0.10);
+    d->nbounces[slot] = res.nbounces;
+}
+
+static int commit(long i, int slot, void *ctx){
+    t_density *d = ctx;
+    d->progress.nevents += d->nbounces[slot];
+    if (i % 100 == 0) progress_report(&d->progress, i);
+    return 0;
+}
 
 int main(int argc, char **argv){
-    if (argc != 2){
-        printf("Incorrect arguments supplied, must be <filename>\n");
+    if (argc < 2 || argc > 4){
+        printf("Incorrect arguments supplied, must be <filename> [nparticles] [bins]\n");
         return 1;
     }
 
-    ran_seed(123123);
-    int clen = 0;
     double R = 0.75/2;
     double damp = 0.9;
     double wall = 14;
     double top = 7.0;
 
-    int MAXPEGS = 1 << 10;
-    int NPARTICLES = 1 << 16;
-    int TIMEPOINTS = 1 << 11;
+    long NPARTICLES = argc > 2 ? atol(argv[2]) : 1 << 16;
+
+    // bins across the board, with as many to the unit up it
+    int NX = argc > 3 ? atoi(argv[3]) : 500;
+    int NY = MAX((int)(NX * top / wall), 1);
 
     char filename[1024];
     char file_track[1024];
-    char file_pegs[1024];
-    char file_conf[1024];
     strcpy(filename, argv[1]);
-    sprintf(file_track, "%s.density", filename);
-    sprintf(file_pegs, "%s.pegs", filename);
-    sprintf(file_conf, "%s.conf", filename);
-
-    int npegs = 0;
-    double *pegs = malloc(sizeof(double)*2*MAXPEGS);
-    double *bounces = malloc(sizeof(double)*2*TIMEPOINTS);
-    t_result *res = malloc(sizeof(t_result));
-
-    build_hex_grid(pegs, &npegs, MAXPEGS, 4, 16);
-
-    FILE *file = fopen(file_conf, "w");
-    fprintf(file, "radius: %f\n", R);
-    fprintf(file, "damp: %f\n", damp);
-    fprintf(file, "wall: %f\n", wall);
-    fprintf(file, "top: %f\n", top);
-    fprintf(file, "nparticles: %i\n", NPARTICLES);
-    fprintf(file, "timepoints: %i\n", TIMEPOINTS);
-    fclose(file);
-
-    file = fopen(file_pegs, "wb");
-    fwrite(pegs, sizeof(double), npegs*2, file);
-    fclose(file);
-
-    double pos[2] = { wall / 2, 10.0 };
-    double vel[2] = { 0, 1e-4 };
-    double len[2] = { 0, 0 };
-
-    for (int i=0; i<NPARTICLES; i++){
-        pos[0] = wall/2 - 0.5 + ran_ran2();
-        pos[1] = top;
-        vel[0] = 0.0;
-        vel[1] = 1e-4;
-
-        if (i % 100 == 0) printf("%i\n", i);
-
-        for (int j=0; j<2*TIMEPOINTS; j++)
-            bounces[j] = 0.0;
-
-        clen = trackTrajectory(pos, vel, R, wall, damp,
-            pegs, npegs, res, TIMEPOINTS, bounces, 1, 0.10);
-
-        len[0] = len[1] = (double)clen/2;
-
-        FILE *tfile = fopen(file_track, "ab");
-        fwrite(len, sizeof(double), 2, tfile);
-        fwrite(bounces, sizeof(double), 2*TIMEPOINTS, tfile);
-        fflush(tfile);
-        fclose(tfile);
+    sprintf(file_track, "%s.plinko", filename);
+
+    t_grid grid;
+
+    build_lattice_grid(&grid, LATTICE_HEX, 4, 16, 0, R);
+    int npegs = grid.npegs;
+    double *pegs = lattice_pegs(&grid);
+
+    // one record of NX counts per row of bins, from the bottom up
+    t_pfile_header header = { "", 0, PFILE_HISTOGRAM, R, damp, wall, top, SEED, 0,
+        NPARTICLES, 0, npegs, 0, sizeof(double)*NX, 0, 0, 0, 0, 0, 0 };
+    t_pfile *track = pfile_create(file_track, &header, pegs, STREAM_ALIGN);
+    if (!track){
+        printf("Could not open %s for writing\n", file_track);
+        return 1;
+    }
+
+    t_density density = { R, damp, wall, top, &grid, NX, NY, 0, NULL, NULL,
+        malloc(sizeof(int)*WINDOW), {0, 0, 0} };
+    t_sweep sweep = { 0, NPARTICLES, WINDOW, work, commit, &density, NULL, NULL };
+    progress_start(&density.progress, 0);
+    sweep_run(&sweep);
+    COUNTERS_PRINT();
+
+    // what the threads kept is freed below, so they forget it
+    #pragma omp parallel
+    {
+        local.counts = NULL;
+        local.sink.buf = NULL;
+    }
+
+    // counts are whole numbers, so the sum does not depend on the threads
+    double *counts = calloc((size_t)NX*NY, sizeof(double));
+    for (int t=0; t<density.nlocals; t++){
+        for (long k=0; k<(long)NX*NY; k++)
+            counts[k] += density.locals[t][k];
+        free(density.locals[t]);
+        free(density.bufs[t]);
+    }
+
+    pfile_write(track, counts, NY);
+    if (pfile_close(track)){
+        printf("Error writing %s\n", file_track);
+        return 1;
     }
 
-    free(bounces);
+    free_peg_grid(&grid);
+    free(density.locals);
+    free(density.bufs);
+    free(density.nbounces);
+    free(counts);
     return 0;
 }
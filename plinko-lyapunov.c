@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "plinkolib.h"
+#include "sweep.h"
+#include "pfile.h"
+#include "sink.h"
+
+/*===========================================================================
+ *  Lyapunov exponents of plinko's drops, from the tangent map that
+ *  trackLyapunov carries along each flight, so one trajectory per particle
+ *  instead of two nearby ones.  The tangent starts as a change of x0.
+ *
+ *      <filename> [nparticles]
+ *          one record per particle (x0, nbounces, time_total, sumlog),
+ *          sumlog / time_total being its finite time exponent
+ *
+ *      --running <filename> <particle>
+ *          (t, sumlog) after every event of that one particle, for its
+ *          running exponent sumlog / t
+ *=========================================================================*/
+#define SEED 123123
+#define WINDOW (1 << 12)
+#define CHUNK (1 << 16)
+
+typedef struct {
+    double R, damp, wall;
+    t_grid *grid;
+    double (*records)[4];
+    t_pfile *file;
+    double sumtime, sumbounce;
+    long nbounced;
+} t_run;
+
+static void initial_condition(t_run *run, long i, double *pos, double *vel, t_lyapunov *ly){
+    t_rng rng;
+    rng_seed(&rng, SEED, i);
+    pos[0] = run->wall/2 - 0.5 + rng_ran2(&rng);
+    pos[1] = 10.0;
+    vel[0] = 0;
+    vel[1] = 1e-4;
+
+    t_lyapunov start = { {1, 0, 0, 0}, 0 };
+    *ly = start;
+}
+
+static void work(long i, int slot, void *ctx){
+    t_run *run = ctx;
+    double pos[2], vel[2];
+    t_lyapunov ly;
+    t_result res;
+
+    initial_condition(run, i, pos, vel, &ly);
+    run->records[slot][0] = pos[0];
+    trackLyapunov(pos, vel, run->R, run->wall, run->damp, run->grid,
+        MAXBOUNCES, &res, &ly, NULL);
+    run->records[slot][1] = res.nbounces;
+    run->records[slot][2] = res.time_total;
+    run->records[slot][3] = ly.sumlog;
+}
+
+static int commit(long i, int slot, void *ctx){
+    t_run *run = ctx;
+    double *r = run->records[slot];
+    (void)i;
+
+    pfile_write(run->file, r, 1);
+    if (r[1] > 0){
+        run->sumtime += r[3] / r[2];
+        run->sumbounce += r[3] / r[1];
+        run->nbounced++;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv){
+    int running = argc == 4 && strcmp(argv[1], "--running") == 0;
+    if (!running && argc != 2 && argc != 3){
+        printf("Incorrect arguments supplied, must be <filename> [nparticles]\n");
+        printf("    or --running <filename> <particle>\n");
+        return 1;
+    }
+
+    double R = 0.75/2;
+    double damp = 1.0;
+    double wall = 7;
+    long NPARTICLES = !running && argc == 3 ? atol(argv[2]) : 1L << 16;
+    if (NPARTICLES < 1){
+        printf("nparticles must be positive\n");
+        return 1;
+    }
+
+    char file_track[1024];
+    sprintf(file_track, "%s.plinko", argv[running ? 2 : 1]);
+
+    t_grid grid;
+    build_lattice_grid(&grid, LATTICE_HEX, 4, 8, 0, R);
+    int npegs = grid.npegs;
+    double *pegs = lattice_pegs(&grid);
+
+    t_run run = { R, damp, wall, &grid, NULL, NULL, 0, 0, 0 };
+
+    // per particle (x0, nbounces, time, sumlog), or (t, sumlog) of one
+    t_pfile_header header = { "", 0, PFILE_LYAPUNOV, R, damp, wall, 10.0, SEED, 0,
+        NPARTICLES, 0, npegs, 0, 4*sizeof(double), 0, 0, 0, 0, 0, 0 };
+    if (running){
+        header.content = PFILE_STRETCH;
+        header.nparticles = 1;
+        header.record_size = 2*sizeof(double);
+    }
+    run.file = pfile_create(file_track, &header, pegs, 1 << 16);
+    if (!run.file){
+        printf("Could not open %s for writing\n", file_track);
+        return 1;
+    }
+
+    if (running){
+        long i = atol(argv[3]);
+        double pos[2], vel[2];
+        t_lyapunov ly;
+        t_result res;
+
+        t_sink *sink = sink_pfile(run.file, CHUNK);
+        initial_condition(&run, i, pos, vel, &ly);
+        trackLyapunov(pos, vel, R, wall, damp, &grid, MAXBOUNCES, &res, &ly, sink);
+        printf("%li: bounces %i time %f exponent %f per time, %f per bounce\n", i,
+            res.nbounces, res.time_total, ly.sumlog / res.time_total,
+            ly.sumlog / MAX(res.nbounces, 1));
+        if (sink_close(sink)){
+            printf("Error writing %s\n", file_track);
+            return 1;
+        }
+    } else {
+        run.records = malloc(sizeof(double)*4*WINDOW);
+        t_sweep sweep = { 0, NPARTICLES, WINDOW, work, commit, &run, NULL, NULL };
+        sweep_run(&sweep);
+        printf("%li particles, mean exponent %f per time, %f per bounce\n", NPARTICLES,
+            run.sumtime / MAX(run.nbounced, 1), run.sumbounce / MAX(run.nbounced, 1));
+        free(run.records);
+    }
+
+    if (pfile_close(run.file))
+        printf("Error writing %s\n", file_track);
+
+    free_peg_grid(&grid);
+    free(pegs);
+    return 0;
+}
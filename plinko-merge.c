@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pfile.h"
+
+/*===========================================================================
+ *  Puts the shards of a run split with --shard back into the one file the
+ *  run would have written on its own.  The shards must all be of the same
+ *  run (same content, hash and record layout, and a hash that matches
+ *  their pegs), and between them hold every particle exactly once: any
+ *  range missing or held twice is reported and nothing is written.
+ *
+ *      plinko-merge <output.plinko> <shard.plinko> ...
+ *=========================================================================*/
+#define CHUNK (1 << 16)
+
+typedef struct {
+    const char *name;
+    t_pfile_header header;
+} t_shard;
+
+static int by_first(const void *a, const void *b){
+    const t_shard *x = a, *y = b;
+    return (x->header.first > y->header.first) - (x->header.first < y->header.first);
+}
+
+static int same_run(t_pfile_header *a, t_pfile_header *b){
+    return a->content == b->content && a->hash == b->hash && a->seed == b->seed &&
+        a->nparticles == b->nparticles && a->timepoints == b->timepoints &&
+        a->npegs == b->npegs && a->record_size == b->record_size &&
+        a->nshards == b->nshards;
+}
+
+static int copy_records(t_shard *s, t_pfile *out, char **buf, size_t *maxbuf){
+    t_pfile_header *h = &s->header;
+
+    if (h->record_size){
+        for (uint64_t i=0; i<h->nrecords; i+=CHUNK){
+            uint64_t n = MIN((uint64_t)CHUNK, h->nrecords - i);
+            if (pfile_read(s->name, h->records_offset + i*h->record_size, *buf, n*h->record_size))
+                return 1;
+            pfile_write(out, *buf, n);
+        }
+        return 0;
+    }
+
+    // variable length records, one at a time through the index
+    uint64_t *index = malloc(sizeof(uint64_t)*(h->nrecords+1));
+    int error = pfile_read(s->name, h->index_offset, index, sizeof(uint64_t)*(h->nrecords+1));
+    for (uint64_t i=0; i<h->nrecords && !error; i++){
+        size_t len = index[i+1] - index[i];
+        if (len > *maxbuf){
+            *maxbuf = len;
+            *buf = realloc(*buf, len);
+        }
+        error = pfile_read(s->name, h->records_offset + index[i], *buf, len);
+        if (!error) pfile_write(out, *buf, len);
+    }
+    free(index);
+    return error;
+}
+
+int main(int argc, char **argv){
+    if (argc < 3){
+        printf("Incorrect arguments supplied, must be <output> <shard> [shard ...]\n");
+        return 1;
+    }
+
+    int nshards = argc - 2;
+    t_shard *shards = calloc(nshards, sizeof(t_shard));
+    double *pegs = NULL;
+    int bad = 0;
+
+    for (int k=0; k<nshards; k++){
+        t_shard *s = &shards[k];
+        t_pfile_header *h = &s->header;
+        s->name = argv[k+2];
+
+        if (pfile_read_header(s->name, h)){
+            printf("%s is not a plinko file\n", s->name);
+            return 1;
+        }
+        if (h->nshards == 0){
+            printf("%s is a whole run, not a shard\n", s->name);
+            return 1;
+        }
+        if (k > 0 && !same_run(h, &shards[0].header)){
+            printf("%s is not a shard of the same run as %s\n", s->name, shards[0].name);
+            return 1;
+        }
+
+        // the hash has to be the one of the pegs the shard carries
+        double *p = malloc(sizeof(double)*2*MAX(h->npegs, 1));
+        if (pfile_read(s->name, h->pegs_offset, p, sizeof(double)*2*h->npegs) ||
+                pfile_hash(h, p) != h->hash){
+            printf("%s has a configuration hash that does not match its contents\n", s->name);
+            return 1;
+        }
+        if (k == 0) pegs = p;
+        else free(p);
+    }
+
+    // the shards' ranges have to tile 0 .. nparticles-1
+    qsort(shards, nshards, sizeof(t_shard), by_first);
+    uint64_t next = 0, total = shards[0].header.nparticles;
+    for (int k=0; k<nshards; k++){
+        t_pfile_header *h = &shards[k].header;
+        if (h->first > next){
+            printf("missing particles %lu to %lu\n", (unsigned long)next, (unsigned long)h->first-1);
+            bad = 1;
+        }
+        if (h->first < next){
+            printf("particles %lu to %lu are in %s and an earlier shard\n", (unsigned long)h->first,
+                (unsigned long)MIN(next, h->first + h->nrecords)-1, shards[k].name);
+            bad = 1;
+        }
+        next = MAX(next, h->first + h->nrecords);
+    }
+    if (next < total){
+        printf("missing particles %lu to %lu\n", (unsigned long)next, (unsigned long)total-1);
+        bad = 1;
+    }
+    if (next > total){
+        printf("more particles than the run's %lu\n", (unsigned long)total);
+        bad = 1;
+    }
+    if (bad){
+        printf("Not merging %i shards of %lu\n", nshards, (unsigned long)shards[0].header.nshards);
+        return 1;
+    }
+
+    t_pfile_header header = shards[0].header;
+    header.shard = header.nshards = header.first = 0;
+    t_pfile *out = pfile_create(argv[1], &header, pegs, 1 << 16);
+    if (!out){
+        printf("Could not open %s for writing\n", argv[1]);
+        return 1;
+    }
+
+    size_t maxbuf = CHUNK*MAX(header.record_size, 1);
+    char *buf = malloc(maxbuf);
+    for (int k=0; k<nshards && !bad; k++){
+        bad = copy_records(&shards[k], out, &buf, &maxbuf);
+        if (bad) printf("Could not read the records of %s\n", shards[k].name);
+    }
+
+    if (pfile_close(out) || bad){
+        printf("Error writing %s\n", argv[1]);
+        return 1;
+    }
+    if (header.hash != shards[0].header.hash){
+        printf("%s came out with a different configuration hash\n", argv[1]);
+        return 1;
+    }
+    printf("%i shards, %lu particles into %s\n", nshards, (unsigned long)total, argv[1]);
+
+    free(buf);
+    free(pegs);
+    free(shards);
+    return 0;
+}
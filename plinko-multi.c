@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "plinkolib.h"
+#include "multi.h"
+#include "pfile.h"
+#include "counters.h"
+
+/*===========================================================================
+ *  nballs balls dropped together onto the board, packed in rows above it
+ *  with a little random jitter across, knocking into each other on the
+ *  way down.  The bounces of each ball, pegs and balls alike, go to
+ *  <filename>.plinko in ball order as plinko writes them per particle.
+ *=========================================================================*/
+#define SEED 123123
+
+int main(int argc, char **argv){
+    if (argc < 2 || argc > 4){
+        printf("Incorrect arguments supplied, must be <filename> [nballs] [diameter]\n");
+        return 1;
+    }
+
+    double R = 0.75/2;
+    double damp = 1.0;
+    double wall = 14;
+    double top = 10.0;
+
+    int NBALLS = argc > 2 ? atoi(argv[2]) : 1 << 12;
+    double D = argc > 3 ? atof(argv[3]) : 0.25;
+
+    char file_track[1024];
+    sprintf(file_track, "%s.plinko", argv[1]);
+
+    t_grid grid;
+    build_lattice_grid(&grid, LATTICE_HEX, 4, 16, 0, R);
+    int npegs = grid.npegs;
+    double *pegs = lattice_pegs(&grid);
+
+    // rows of balls half a diameter apart, from the top of the board up
+    double gap = 1.5*D;
+    int across = MAX((int)((wall - gap) / gap), 1);
+    double *pos = malloc(sizeof(double)*2*NBALLS);
+    double *vel = malloc(sizeof(double)*2*NBALLS);
+    t_rng rng;
+
+    for (int i=0; i<NBALLS; i++){
+        rng_seed(&rng, SEED, i);
+        pos[2*i+0] = gap*(i % across + 1) + 0.1*D*(rng_ran2(&rng) - 0.5);
+        pos[2*i+1] = top + gap*(i / across);
+        vel[2*i+0] = 0;
+        vel[2*i+1] = 1e-4;
+    }
+
+    t_multi multi;
+    clock_t start = clock();
+    multi_init(&multi, NBALLS, pos, vel, R, D, wall, damp, &grid);
+    multi_run(&multi);
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    t_multistats *s = &multi.stats;
+    printf("%i balls, %llu events in %f s (%e per second)\n",
+            NBALLS, s->nevents, secs, s->nevents / secs);
+    printf("    bounces %llu, contacts %llu, crossings %llu, out of date %llu\n",
+            s->nbounces, s->npairs, s->ncrossings, s->nstale);
+    COUNTERS_FOLD();
+    COUNTERS_PRINT();
+
+    t_pfile_header header = { "", 0, PFILE_BOUNCES, R, damp, wall, top, SEED, 0,
+        NBALLS, 0, npegs, 0, sizeof(double), 0, 0, 0, 0, 0, 0 };
+    t_pfile *track = pfile_create(file_track, &header, pegs, 1 << 16);
+    if (!track){
+        printf("Could not open %s for writing\n", file_track);
+        return 1;
+    }
+    for (int i=0; i<NBALLS; i++){
+        double bounces = multi.balls[i].res.nbounces;
+        pfile_write(track, &bounces, 1);
+    }
+    if (pfile_close(track)){
+        printf("Error writing %s\n", file_track);
+        return 1;
+    }
+
+    multi_free(&multi);
+    free_peg_grid(&grid);
+    free(pegs);
+    free(pos);
+    free(vel);
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "plinkolib.h"
+#include "sweep.h"
+#include "batch.h"
+#include "pfile.h"
+#include "shadow.h"
+
+/*===========================================================================
+ *  How far plinko's flights can be trusted, by shadowing.  These are the
+ *  drops plinko makes, flown by the same batch engine; built with
+ *  REPRODUCIBLE=1 (see the Makefile) the bounce counts here are the ones
+ *  in plinko's file, bit for bit.  A first pass flags the flights where
+ *  rounding decides the most (see shadow.h).  Only those are run again, in
+ *  double and long double side by side, to find the bounce at which the
+ *  two part.  A flight's bounces up to there are the same
+ *  whatever the precision, past it they are one of many flights the board
+ *  could have made.
+ *
+ *  <filename>.plinko gets a record per flagged flight: (particle, flags,
+ *  nbounces, ext_nbounces, diverged, maxdev, xfinal, ext_xfinal).
+ *=========================================================================*/
+#define SEED 123123
+#define WINDOW (1 << 12)
+
+typedef struct {
+    double R, damp, wall;
+    t_grid *grid;
+    double *pegs;
+    int npegs, longlived, maxbounces;
+
+    // the first pass, and the flights it picked out
+    t_sweep *sweep;
+    int *flags, *nbounces;
+    long *flagged, nflagged, maxflagged;
+    int *flagbits;
+    long nflags[3];
+
+    // the second
+    t_shadow *shadow;
+    t_pfile *file;
+    long ndiverged, ncup, sumdiverged;
+} t_run;
+
+static void initial_condition(t_run *run, long i, double *pos, double *vel){
+    t_rng rng;
+    rng_seed(&rng, SEED, i);
+    pos[0] = run->wall/2 - 0.5 + rng_ran2(&rng);
+    pos[1] = 10.0;
+    vel[0] = 0;
+    vel[1] = 1e-4;
+}
+
+static int flag_next(void *ctx, int wait, long *i, double *pos, double *vel){
+    t_run *run = ctx;
+    int got = sweep_next(run->sweep, i, wait);
+    if (got == 1){
+        initial_condition(run, *i, pos, vel);
+        run->flags[*i % WINDOW] = 0;
+    }
+    return got;
+}
+
+static int flag_event(void *ctx, long i, int result, double tcoll,
+        double *peg, double *pos, double *vel){
+    t_run *run = ctx;
+    int *flags = &run->flags[i % WINDOW];
+    *flags = shadow_event(*flags, pos, vel, run->R, result, tcoll, peg,
+        run->pegs, run->npegs);
+    return 1;
+}
+
+static void flag_done(void *ctx, long i, t_result *res){
+    t_run *run = ctx;
+    run->nbounces[i % WINDOW] = res->nbounces;
+    if (res->nbounces >= run->longlived) run->flags[i % WINDOW] |= SHADOW_LONG;
+    sweep_done(run->sweep, i);
+}
+
+static void flag_batch(t_sweep *sweep, void *ctx){
+    t_run *run = ctx;
+    (void)sweep;
+    trackCollisionBatchEvents(run->R, run->wall, run->damp, run->grid,
+        flag_next, flag_done, flag_event, ctx);
+}
+
+static int flag_commit(long i, int slot, void *ctx){
+    t_run *run = ctx;
+    int flags = run->flags[slot];
+    if (!flags) return 0;
+
+    for (int k=0; k<3; k++)
+        if (flags & (1 << k)) run->nflags[k]++;
+    if (run->nflagged == run->maxflagged){
+        run->maxflagged *= 2;
+        run->flagged = realloc(run->flagged, sizeof(long)*run->maxflagged);
+        run->flagbits = realloc(run->flagbits, sizeof(int)*run->maxflagged);
+    }
+    run->flagbits[run->nflagged] = flags;
+    run->flagged[run->nflagged++] = i;
+    return 0;
+}
+
+static void shadow_work(long i, int slot, void *ctx){
+    t_run *run = ctx;
+    double pos[2], vel[2];
+    initial_condition(run, run->flagged[i], pos, vel);
+    shadow_run(pos, vel, run->R, run->wall, run->damp, run->grid,
+        run->pegs, run->npegs, run->maxbounces, &run->shadow[slot]);
+}
+
+static int shadow_commit(long i, int slot, void *ctx){
+    t_run *run = ctx;
+    t_shadow *s = &run->shadow[slot];
+    long particle = run->flagged[i];
+
+    double record[8] = { particle, run->flagbits[i], s->nbounces, s->ext_nbounces,
+        s->diverged, s->maxdev, s->xfinal, s->ext_xfinal };
+    pfile_write(run->file, record, 1);
+
+    if (s->diverged >= 0){
+        run->ndiverged++;
+        run->sumdiverged += s->diverged;
+    }
+    if (floor(s->xfinal) == floor(s->ext_xfinal)) run->ncup++;
+    return 0;
+}
+
+int main(int argc, char **argv){
+    if (argc < 2 || argc > 5){
+        printf("Incorrect arguments supplied, must be <filename> [nparticles] [longlived] [maxbounces]\n");
+        return 1;
+    }
+
+    double R = 0.75/2;
+    double damp = 1.0;
+    double wall = 7;
+    long NPARTICLES = argc > 2 ? atol(argv[2]) : 1L << 16;
+    int LONGLIVED = argc > 3 ? atoi(argv[3]) : 1000;
+    int MAXSHADOW = argc > 4 ? atoi(argv[4]) : 1 << 14;
+    if (NPARTICLES < 1 || LONGLIVED < 1 || MAXSHADOW < 1){
+        printf("nparticles, longlived and maxbounces must all be positive\n");
+        return 1;
+    }
+
+    char file_track[1024];
+    sprintf(file_track, "%s.plinko", argv[1]);
+
+    t_grid grid;
+    build_lattice_grid(&grid, LATTICE_HEX, 4, 8, 0, R);
+    int npegs = grid.npegs;
+    double *pegs = lattice_pegs(&grid);
+
+    t_run run = { R, damp, wall, &grid, pegs, npegs, LONGLIVED, MAXSHADOW,
+        NULL, malloc(sizeof(int)*WINDOW), malloc(sizeof(int)*WINDOW),
+        malloc(sizeof(long)*1024), 0, 1024, malloc(sizeof(int)*1024), {0, 0, 0},
+        malloc(sizeof(t_shadow)*WINDOW), NULL, 0, 0, 0 };
+
+    t_sweep flag = { 0, NPARTICLES, WINDOW, NULL, flag_commit, &run, flag_batch, NULL };
+    run.sweep = &flag;
+    sweep_run(&flag);
+    printf("%li particles, %li flagged: %li long lived, %li grazing, %li near misses\n",
+        NPARTICLES, run.nflagged, run.nflags[0], run.nflags[1], run.nflags[2]);
+
+    t_pfile_header header = { "", 0, PFILE_SHADOW, R, damp, wall, 10.0, SEED, 0,
+        run.nflagged, 0, npegs, 0, 8*sizeof(double), 0, 0, 0, 0, 0, 0 };
+    run.file = pfile_create(file_track, &header, pegs, 1 << 16);
+    if (!run.file){
+        printf("Could not open %s for writing\n", file_track);
+        return 1;
+    }
+
+    if (run.nflagged){
+        t_sweep sweep = { 0, run.nflagged, WINDOW, shadow_work, shadow_commit, &run, NULL, NULL };
+        sweep_run(&sweep);
+    }
+    printf("%li of them parted from long double, at bounce %.1f on average, "
+        "%li ended in the same cup\n",
+        run.ndiverged, (double)run.sumdiverged / MAX(run.ndiverged, 1), run.ncup);
+
+    if (pfile_close(run.file))
+        printf("Error writing %s\n", file_track);
+
+    free(run.flags);
+    free(run.nbounces);
+    free(run.flagged);
+    free(run.flagbits);
+    free(run.shadow);
+    free_peg_grid(&grid);
+    free(pegs);
+    return 0;
+}
@@ -6,10 +6,21 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include "plinkolib.h"
+#include "pfile.h"
+#include "sink.h"
+
+/* the trajectory goes out through one of the sinks, by default streamed
+ * to the file a chunk at a time */
+#define CHUNK    (1 << 16)
+#define DECIMATE (1 << 20)
 
 int main(int argc, char **argv){
-    if (argc != 2){
-        printf("Incorrect arguments supplied, must be <filename>\n");
+    const char *mode = argc == 3 ? argv[1] : "";
+    int events = strcmp(mode, "--events") == 0;
+    int mapped = strcmp(mode, "--mmap") == 0;
+    int decimate = strcmp(mode, "--decimate") == 0;
+    if (argc != 2 && !(events || mapped || decimate)){
+        printf("Incorrect arguments supplied, must be [--events|--mmap|--decimate] <filename>\n");
         return 1;
     }
 
@@ -18,20 +29,12 @@ int main(int argc, char **argv){
     double wall = 7.0;
     double top = 7.0;
     char filename[1024];
-    strcpy(filename, argv[1]);
+    strcpy(filename, argv[argc-1]);
 
     char file_track[1024];
-    char file_pegs[1024];
-    char file_conf[1024];
-    sprintf(file_track, "%s.track", filename);
-    sprintf(file_pegs, "%s.pegs", filename);
-    sprintf(file_conf, "%s.conf", filename);
+    sprintf(file_track, "%s.plinko", filename);
 
-    int TIMEPOINTS = 1 << 26;
-    int MAXPEGS = 1 << 10;
-    int npegs = 0;
-    double *pegs = malloc(sizeof(double)*2*MAXPEGS);
-    double *bounces = malloc(sizeof(double)*2*TIMEPOINTS);
+    t_grid grid;
     t_result *res = malloc(sizeof(t_result));
 
     double pos[2] = { wall / 3. + 1e-3, 10.0 };
@@ -42,26 +45,57 @@ int main(int argc, char **argv){
     vel[0] = 0.0;
     vel[1] = 1e-4;
 
-    build_hex_grid(pegs, &npegs, MAXPEGS, 4, 8);
+    build_lattice_grid(&grid, LATTICE_HEX, 4, 8, 0, R);
+    int npegs = grid.npegs;
+    double *pegs = lattice_pegs(&grid);
+
+    // one record per (x, y) point of the trajectory, or per event logged
+    t_pfile_header header = { "", 0, PFILE_POINTS, R, damp, wall, top, 0, 0,
+        1, 0, npegs, 0, 2*sizeof(double), 0, 0, 0, 0, 0, 0 };
+    if (events){
+        header.content = PFILE_EVENTS;
+        header.record_size = sizeof(t_event);
+    }
+    t_pfile *file = pfile_create(file_track, &header, pegs, STREAM_BUFFER);
+    if (!file){
+        printf("Could not open %s for writing\n", file_track);
+        return 1;
+    }
 
-    int clen = trackTrajectory(pos, vel, R, wall, damp,
-            pegs, npegs, res, TIMEPOINTS, bounces, 0, 0.008);
+    t_sink *sink;
+    if (mapped)
+        sink = sink_mmap(file, CHUNK);
+    else if (decimate)
+        sink = sink_decimate(header.record_size, DECIMATE);
+    else
+        sink = sink_pfile(file, CHUNK);
+    if (!sink){
+        printf("Could not map %s\n", file_track);
+        return 1;
+    }
 
-    FILE *file = fopen(file_track, "wb");
-    fwrite(bounces, sizeof(double), clen, file);
-    fclose(file);
+    long n;
+    if (events)
+        n = trackEvents(pos, vel, R, wall, damp, &grid, res, sink);
+    else
+        n = trackTrajectory(pos, vel, R, wall, damp, &grid, res, sink, 0, 0.008);
+    printf("%li records, %i bounces\n", n, res->nbounces);
 
-    file = fopen(file_pegs, "wb");
-    fwrite(pegs, sizeof(double), npegs*2, file);
-    fclose(file);
+    if (decimate){
+        long nkept, stride;
+        void *kept = sink_kept(sink, &nkept, &stride);
+        pfile_write(file, kept, nkept);
+        printf("kept every %li of them\n", stride);
+    }
 
-    file = fopen(file_conf, "w");
-    fprintf(file, "radius: %f\n", R);
-    fprintf(file, "damp: %f\n", damp);
-    fprintf(file, "wall: %f\n", wall);
-    fprintf(file, "top: %f\n", top);
-    fclose(file);
+    // the sink's last records go through the file, so it closes first
+    int error = sink_close(sink);
+    error |= pfile_close(file);
+    if (error){
+        printf("Error writing %s\n", file_track);
+        return 1;
+    }
 
-    free(bounces);
+    free_peg_grid(&grid);
     return 0;
 }
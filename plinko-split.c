@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "plinkolib.h"
+#include "sweep.h"
+
+/*===========================================================================
+ *  Multilevel splitting for the rare particles that bounce for very long,
+ *  on plinko's board.  Levels are bounce counts step, 2*step, ...,
+ *  nlevels*step.  Each level has the same nper flights:
+ *
+ *      level 1     nper fresh drops, as plinko makes them
+ *      level k     nper states drawn with replacement from the flights
+ *                  that reached level k-1 bounces, each where it was
+ *                  just after that bounce
+ *
+ *  Each flight runs until it either reaches the level's bounce count or
+ *  ends.  The fraction that got there, p_k, is an unbiased estimate of
+ *  P(N >= level k | N >= level k-1), and their product of P(N >= level
+ *  k).  Counting a level's bounces costs only step per flight, not the
+ *  whole flight from the top.
+ *
+ *  The flights are deterministic, so clones of one state would all do
+ *  the same thing.  Every flight that crosses a level therefore has its
+ *  velocity turned by a random angle of at most SPLIT_KICK.  The
+ *  estimates are exact for flights kicked this way.  The board is
+ *  chaotic, so a kick this small changes which flight it is within a few
+ *  bounces, but it does not change the statistics of the flights.
+ *
+ *  <filename>.split lists the estimate per level, then every flight that
+ *  reached the last level: its drop, its kicks, and its total bounce
+ *  count when run on to the end.
+ *=========================================================================*/
+#define SEED 123123
+#define SPLIT_KICK 1e-8
+
+typedef struct {
+    double pos[2], vel[2];
+    long drop;          // the particle of plinko's drop it comes from
+    int parent;         // its state at the level before, -1 for a drop
+    int reached;
+} t_state;
+
+typedef struct {
+    double R, damp, wall;
+    t_grid *grid;
+    int level, step, nper;
+    t_state *from, *to;
+    int *reached, nreached;     // the flights of from that got there
+    double *kick;       // per level and flight, the angle it was turned by
+    double *bounces;
+    ullong spent;
+} t_split;
+
+static void rotate(double *vel, double angle){
+    double c = cos(angle), s = sin(angle);
+    double vx = vel[0], vy = vel[1];
+    vel[0] = c*vx - s*vy;
+    vel[1] = s*vx + c*vy;
+}
+
+static void work(long i, int slot, void *ctx){
+    t_split *s = ctx;
+    t_state *st = &s->to[i];
+    t_result res;
+    t_rng rng;
+    (void)slot;
+
+    // the draws of flight i at level k only depend on (k, i)
+    rng_seed(&rng, SEED, (ullong)s->level*s->nper + i);
+
+    if (s->level == 0){
+        st->pos[0] = s->wall/2 - 0.5 + rng_ran2(&rng);
+        st->pos[1] = 10.0;
+        st->vel[0] = 0;
+        st->vel[1] = 1e-4;
+        st->drop = i;
+        st->parent = -1;
+    } else {
+        // a uniform pick of the flights that got here, kicked
+        int j = s->reached[(int)(rng_ran2(&rng) * s->nreached)];
+        *st = s->from[j];
+        st->parent = j;
+        s->kick[(long)s->level*s->nper + i] = SPLIT_KICK*(2*rng_ran2(&rng) - 1);
+        rotate(st->vel, s->kick[(long)s->level*s->nper + i]);
+    }
+
+    int n = trackBounces(st->pos, st->vel, s->R, s->wall, s->damp, s->grid, s->step, &res);
+    st->reached = n == s->step;
+    s->bounces[slot] = n;
+}
+
+static int commit(long i, int slot, void *ctx){
+    t_split *s = ctx;
+    (void)i;
+    s->spent += s->bounces[slot];
+    return 0;
+}
+
+int main(int argc, char **argv){
+    if (argc < 2 || argc > 5){
+        printf("Incorrect arguments supplied, must be <filename> [nlevels] [step] [nper]\n");
+        return 1;
+    }
+
+    double R = 0.75/2;
+    double damp = 1.0;
+    double wall = 7;
+
+    int NLEVELS = argc > 2 ? atoi(argv[2]) : 8;
+    int STEP = argc > 3 ? atoi(argv[3]) : 200;
+    int NPER = argc > 4 ? atoi(argv[4]) : 2048;
+    if (NLEVELS < 1 || STEP < 1 || NPER < 1){
+        printf("nlevels, step and nper must all be positive\n");
+        return 1;
+    }
+
+    char file_split[1024];
+    sprintf(file_split, "%s.split", argv[1]);
+    FILE *out = fopen(file_split, "w");
+    if (!out){
+        printf("Could not open %s for writing\n", file_split);
+        return 1;
+    }
+
+    t_grid grid;
+    build_lattice_grid(&grid, LATTICE_HEX, 4, 8, 0, R);
+
+    // the states of every level are kept, to trace the last ones back
+    t_state *states = malloc(sizeof(t_state)*NLEVELS*NPER);
+    t_split split = { R, damp, wall, &grid, 0, STEP, NPER, NULL, NULL,
+        malloc(sizeof(int)*NPER), 0, calloc((size_t)NLEVELS*NPER, sizeof(double)),
+        malloc(sizeof(double)*NPER), 0 };
+
+    double p = 1, relvar = 0, mean = 0;
+    int nlevels = 0;
+    fprintf(out, "# level bounces reached p P(N>=bounces) relerr\n");
+    printf("%6s %10s %8s %10s %14s %8s\n", "level", "bounces", "reached", "p", "P(N>=bounces)", "relerr");
+
+    for (int k=0; k<NLEVELS; k++){
+        split.level = k;
+        split.from = k ? &states[(long)(k-1)*NPER] : NULL;
+        split.to = &states[(long)k*NPER];
+
+        t_sweep sweep = { 0, NPER, NPER, work, commit, &split, NULL, NULL };
+        sweep_run(&sweep);
+        nlevels++;
+
+        int reached = 0;
+        for (int i=0; i<NPER; i++)
+            if (split.to[i].reached) split.reached[reached++] = i;
+        split.nreached = reached;
+
+        // a lower bound on how long a uniform drop lasts, cut off at step
+        if (k == 0)
+            for (int i=0; i<NPER; i++) mean += split.bounces[i] / NPER;
+
+        // relative error as if the levels were independent, which
+        // resampling makes a little optimistic
+        double pk = (double)reached / NPER;
+        p *= pk;
+        relvar += reached ? (1 - pk) / (pk * NPER) : INFINITY;
+
+        printf("%6i %10li %8i %10.4f %14.6e %8.3f\n", k+1, (long)(k+1)*STEP, reached, pk, p, sqrt(relvar));
+        fprintf(out, "%i %li %i %f %e %f\n", k+1, (long)(k+1)*STEP, reached, pk, p, sqrt(relvar));
+        if (!reached) break;
+    }
+
+    // what uniform drops would cost for the same error on the last level
+    if (p > 0){
+        double ndrops = (1 - p) / (p * relvar);
+        printf("%llu bounces spent, uniform drops would need about %.3g (%.3g drops)\n",
+            split.spent, ndrops * mean, ndrops);
+    } else
+        printf("%llu bounces spent, no flight reached the last level\n", split.spent);
+
+    // every flight that made it to the end, traced back to its drop
+    t_state *last = &states[(long)(nlevels-1)*NPER];
+    fprintf(out, "# found: drop x0 kicks... total_bounces\n");
+    int nfound = 0;
+    for (int i=0; i<NPER && p > 0; i++){
+        if (!last[i].reached) continue;
+
+        // kicks in level order, from the drop down to this flight
+        double kicks[NLEVELS];
+        int j = i;
+        for (int k=nlevels-1; k>=1; k--){
+            kicks[k] = split.kick[(long)k*NPER + j];
+            j = states[(long)k*NPER + j].parent;
+        }
+
+        t_result res;
+        double pos[2] = {last[i].pos[0], last[i].pos[1]};
+        double vel[2] = {last[i].vel[0], last[i].vel[1]};
+        trackBounces(pos, vel, R, wall, damp, &grid, MAXBOUNCES, &res);
+
+        t_rng rng;
+        rng_seed(&rng, SEED, last[i].drop);
+        fprintf(out, "%li %.17g", last[i].drop, wall/2 - 0.5 + rng_ran2(&rng));
+        for (int k=1; k<nlevels; k++)
+            fprintf(out, " %.17g", kicks[k]);
+        fprintf(out, " %li\n", (long)nlevels*STEP + res.nbounces);
+        nfound++;
+    }
+    printf("%i flights found past %li bounces, in %s\n", nfound, (long)nlevels*STEP, file_split);
+
+    fclose(out);
+    free(states);
+    free(split.reached);
+    free(split.kick);
+    free(split.bounces);
+    free_peg_grid(&grid);
+    return 0;
+}
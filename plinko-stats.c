@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "plinkolib.h"
+#include "sweep.h"
+#include "batch.h"
+#include "stats.h"
+#include "counters.h"
+
+/*===========================================================================
+ *  plinko's drops, the same particles for the same (SEED, i), but only
+ *  their statistics are kept (see stats.h) and not a record per particle.
+ *  Each thread adds into its own t_stats through its batch, and those are
+ *  merged once it is done.  Memory and <filename>.stats stay a few
+ *  kilobytes for any number of particles.
+ *=========================================================================*/
+#define SEED 123123
+#define WINDOW (1 << 14)
+#define REPORT (1 << 22)
+
+typedef struct {
+    double R, damp, wall;
+    t_grid *grid;
+    t_sweep *sweep;
+    int *bounces;       // per slot, for the progress report
+    t_stats total;
+    t_progress progress;
+} t_run;
+
+typedef struct {
+    t_run *run;
+    t_stats stats;
+} t_thread;
+
+static int next(void *ctx, int wait, long *i, double *pos, double *vel){
+    t_thread *th = ctx;
+    int got = sweep_next(th->run->sweep, i, wait);
+    if (got == 1){
+        t_rng rng;
+        rng_seed(&rng, SEED, *i);
+        pos[0] = th->run->wall/2 - 0.5 + rng_ran2(&rng);
+        pos[1] = 10.0;
+        vel[0] = 0;
+        vel[1] = 1e-4;
+    }
+    return got;
+}
+
+static void done(void *ctx, long i, t_result *res){
+    t_thread *th = ctx;
+    stats_add(&th->stats, res);
+    th->run->bounces[i % WINDOW] = res->nbounces;
+    sweep_done(th->run->sweep, i);
+}
+
+static void batch(t_sweep *sweep, void *ctx){
+    t_run *run = ctx;
+    t_thread th;
+    (void)sweep;
+
+    th.run = run;
+    stats_init(&th.stats);
+    trackCollisionBatch(run->R, run->wall, run->damp, run->grid, next, done, &th);
+
+    #pragma omp critical(stats_merge)
+    stats_merge(&run->total, &th.stats);
+}
+
+static int commit(long i, int slot, void *ctx){
+    t_run *run = ctx;
+    if (i % REPORT == 0)
+        progress_report(&run->progress, i);
+    run->progress.nevents += run->bounces[slot];
+    return 0;
+}
+
+int main(int argc, char **argv){
+    if (argc != 2 && argc != 3){
+        printf("Incorrect arguments supplied, must be <filename> [nparticles]\n");
+        return 1;
+    }
+
+    double R = 0.75/2;
+    double damp = 1.0;
+    double wall = 7;
+    long NPARTICLES = argc > 2 ? (long)atof(argv[2]) : 1L << 25;
+    if (NPARTICLES < 1){
+        printf("nparticles must be positive\n");
+        return 1;
+    }
+
+    char file_stats[1024];
+    sprintf(file_stats, "%s.stats", argv[1]);
+
+    t_grid grid;
+    build_lattice_grid(&grid, LATTICE_HEX, 4, 8, 0, R);
+
+    t_run run;
+    run.R = R; run.damp = damp; run.wall = wall;
+    run.grid = &grid;
+    run.bounces = malloc(sizeof(int)*WINDOW);
+    stats_init(&run.total);
+
+    t_sweep sweep = { 0, NPARTICLES, WINDOW, NULL, commit, &run, batch, NULL };
+    run.sweep = &sweep;
+    progress_start(&run.progress, 0);
+    sweep_run(&sweep);
+    progress_report(&run.progress, NPARTICLES);
+
+    stats_print(stdout, &run.total);
+    if (stats_write(file_stats, &run.total))
+        printf("Error writing %s\n", file_stats);
+    COUNTERS_PRINT();
+
+    free(run.bounces);
+    free_peg_grid(&grid);
+    return 0;
+}
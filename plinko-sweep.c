@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "plinkolib.h"
+#include "sweep.h"
+#include "pfile.h"
+#include "counters.h"
+
+/*===========================================================================
+ *  A parameter study in one process: every point of the grid of values
+ *  given on the command line gets the bounce counts of nparticles drops,
+ *  written to <prefix>-<point>.plinko as plinko does.  Boards are implicit
+ *  lattices (hex or square), so they can be any size, or with periodic=1
+ *  repeat every cols across (for wall=0, which has no sides).  Points with
+ *  the same lattice, rows, cols, periodic and R share one.  The (point, particle)
+ *  pairs all go through one sweep, so the threads move on to the next
+ *  point's particles while the last of a point are still running.  A
+ *  point's file is opened when its first particle is committed and closed
+ *  with its last, and commits are in order, so only one is open at once
+ *  however many points there are.  With
+ *  --shard the (point, particle) pairs are split the same way, and each
+ *  shard writes only the points it has a part of, for plinko-merge.
+ *=========================================================================*/
+#define SEED 123123
+#define WINDOW (1 << 14)
+#define MAXVALUES 64
+
+/* the values one parameter takes, the default first */
+typedef struct {
+    const char *name;
+    int nvalues;
+    double values[MAXVALUES];
+} t_axis;
+
+enum { AXIS_R, AXIS_DAMP, AXIS_WALL, AXIS_TOP, AXIS_ROWS, AXIS_COLS, AXIS_LATTICE,
+    AXIS_PERIODIC, NAXES };
+
+typedef struct {
+    int lattice, rows, cols, periodic;
+    double R;
+    t_grid grid;
+} t_board;
+
+typedef struct {
+    double R, damp, wall, top;
+    t_board *board;
+    t_pfile *file;
+} t_point;
+
+typedef struct {
+    long nparticles;
+    int npoints;
+    t_point *points;
+    double *bounces;
+    long end;
+    int error;
+
+    // what a point's file is named and headed with
+    const char *prefix;
+    int shard, nshards;
+} t_study;
+
+static void work(long g, int slot, void *ctx){
+    t_study *s = ctx;
+    t_point *p = &s->points[g / s->nparticles];
+    t_result res;
+    t_rng rng;
+
+    rng_seed(&rng, SEED, g % s->nparticles);
+    double pos[2] = { p->wall/2 - 0.5 + rng_ran2(&rng), p->top };
+    double vel[2] = { 0, 1e-4 };
+
+    trackCollision(pos, vel, p->R, p->wall, p->damp, &p->board->grid, &res);
+    s->bounces[slot] = res.nbounces;
+}
+
+static t_pfile *open_point(t_study *s, long k, long first){
+    /* the file of point k, whose first particle here is first */
+    t_point *p = &s->points[k];
+    t_board *board = p->board;
+    char filename[1024];
+
+    // the file still gets the pegs, for the analysis to draw
+    double *pegs = lattice_pegs(&board->grid);
+
+    t_pfile_header header = { "", 0, PFILE_BOUNCES, p->R, p->damp, p->wall, p->top,
+        SEED, 0, s->nparticles, 0, board->grid.npegs, 0, sizeof(double), 0, 0, 0,
+        s->shard, s->nshards > 1 ? s->nshards : 0, first };
+    if (s->nshards > 1)
+        sprintf(filename, "%s-%03li.%i-of-%i.plinko", s->prefix, k, s->shard, s->nshards);
+    else
+        sprintf(filename, "%s-%03li.plinko", s->prefix, k);
+
+    t_pfile *file = pfile_create(filename, &header, pegs, 1 << 16);
+    if (!file) printf("Could not open %s for writing\n", filename);
+    free(pegs);
+    return file;
+}
+
+static int commit(long g, int slot, void *ctx){
+    t_study *s = ctx;
+    long k = g / s->nparticles;
+    t_point *p = &s->points[k];
+
+    if (!p->file){
+        p->file = open_point(s, k, g % s->nparticles);
+        if (!p->file){
+            s->error = 1;
+            return 1;
+        }
+    }
+    pfile_write(p->file, &s->bounces[slot], 1);
+
+    // a point is done as soon as its last particle is in
+    if (g % s->nparticles == s->nparticles-1 || g == s->end-1){
+        s->error |= pfile_close(p->file);
+        p->file = NULL;
+        printf("point %li done\n", k);
+    }
+    return 0;
+}
+
+static int parse_axis(t_axis *axes, const char *arg){
+    const char *eq = strchr(arg, '=');
+    char *end;
+
+    for (int a=0; a<NAXES; a++){
+        if (!eq || strlen(axes[a].name) != (size_t)(eq - arg)) continue;
+        if (strncmp(axes[a].name, arg, eq - arg)) continue;
+
+        axes[a].nvalues = 0;
+        for (const char *c=eq+1; *c; c=end+(*end == ',')){
+            if (axes[a].nvalues == MAXVALUES) return 1;
+            axes[a].values[axes[a].nvalues++] = strtod(c, &end);
+            if (end == c || (*end && *end != ',')) return 1;
+        }
+        return axes[a].nvalues == 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv){
+    int shard, nshards;
+    int badshard = sweep_shard_args(&argc, argv, &shard, &nshards);
+    t_axis axes[NAXES] = {
+        {"R", 1, {0.75/2}}, {"damp", 1, {1.0}}, {"wall", 1, {7}},
+        {"top", 1, {10.0}}, {"rows", 1, {4}}, {"cols", 1, {8}},
+        {"lattice", 1, {LATTICE_HEX}}, {"periodic", 1, {0}},
+    };
+
+    int bad = badshard || argc < 3 || atol(argv[2]) <= 0;
+    for (int i=3; i<argc && !bad; i++)
+        bad = parse_axis(axes, argv[i]);
+    if (bad){
+        printf("Incorrect arguments supplied, must be <prefix> <nparticles> [name=v1,v2,...]\n");
+        printf("    with name one of R, damp, wall, top, rows, cols, lattice (1 hex, 2 square)\n");
+        printf("    or periodic (0 or 1, for wall=0)\n");
+        printf("    and --shard index/nshards (or --shard mpi) to run one part of it\n");
+        return 1;
+    }
+
+    t_study study = { atol(argv[2]), 1, NULL, NULL, 0, 0, argv[1], shard, nshards };
+    for (int a=0; a<NAXES; a++)
+        study.npoints *= axes[a].nvalues;
+
+    long first;
+    sweep_shard(study.npoints*study.nparticles, shard, nshards, &first, &study.end);
+
+    study.points = calloc(study.npoints, sizeof(t_point));
+    study.bounces = malloc(sizeof(double)*WINDOW);
+    t_board *boards = calloc(study.npoints, sizeof(t_board));
+    int nboards = 0;
+
+    char file_track[1024];
+    sprintf(file_track, "%s.sweep", argv[1]);
+    // the list is the same for every shard, so the first writes it
+    FILE *list = shard == 0 ? fopen(file_track, "w") : NULL;
+    if (shard == 0 && !list){
+        printf("Could not open %s for writing\n", file_track);
+        return 1;
+    }
+    if (list) fprintf(list, "# point R damp wall top rows cols lattice periodic\n");
+
+    for (int k=0; k<study.npoints; k++){
+        // the last parameter varies fastest
+        int j[NAXES], rest = k;
+        for (int a=NAXES-1; a>=0; a--){
+            j[a] = rest % axes[a].nvalues;
+            rest /= axes[a].nvalues;
+        }
+
+        t_point *p = &study.points[k];
+        p->R = axes[AXIS_R].values[j[AXIS_R]];
+        p->damp = axes[AXIS_DAMP].values[j[AXIS_DAMP]];
+        p->wall = axes[AXIS_WALL].values[j[AXIS_WALL]];
+        p->top = axes[AXIS_TOP].values[j[AXIS_TOP]];
+        int rows = (int)axes[AXIS_ROWS].values[j[AXIS_ROWS]];
+        int cols = (int)axes[AXIS_COLS].values[j[AXIS_COLS]];
+        int lattice = (int)axes[AXIS_LATTICE].values[j[AXIS_LATTICE]];
+        int periodic = axes[AXIS_PERIODIC].values[j[AXIS_PERIODIC]] != 0;
+
+        // one board per distinct geometry
+        int b;
+        for (b=0; b<nboards; b++)
+            if (boards[b].lattice == lattice && boards[b].rows == rows &&
+                    boards[b].cols == cols && boards[b].periodic == periodic &&
+                    boards[b].R == p->R)
+                break;
+        if (b == nboards){
+            t_board *board = &boards[nboards++];
+            board->lattice = lattice;
+            board->rows = rows;
+            board->cols = cols;
+            board->periodic = periodic;
+            board->R = p->R;
+            build_lattice_grid(&board->grid, lattice, rows, cols, periodic, p->R);
+        }
+        p->board = &boards[b];
+
+        if (list)
+            fprintf(list, "%i %f %f %f %f %i %i %i %i\n", k, p->R, p->damp, p->wall, p->top,
+                    rows, cols, lattice, periodic);
+    }
+    if (list) fclose(list);
+    printf("%i points on %i boards, %li particles each\n",
+            study.npoints, nboards, study.nparticles);
+    if (nshards > 1)
+        printf("shard %i of %i: pairs %li to %li\n", shard, nshards, first, study.end);
+
+    t_sweep sweep = { first, study.end, WINDOW, work, commit, &study, NULL, NULL };
+    sweep_run(&sweep);
+    COUNTERS_PRINT();
+
+    // a point still open if the sweep was stopped
+    for (int k=0; k<study.npoints; k++)
+        if (study.points[k].file) study.error |= pfile_close(study.points[k].file);
+
+    if (study.error)
+        printf("Error writing the results of %s\n", argv[1]);
+
+    for (int b=0; b<nboards; b++)
+        free_peg_grid(&boards[b].grid);
+    free(boards);
+    free(study.points);
+    free(study.bounces);
+    return study.error;
+}
@@ -6,73 +6,253 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include "plinkolib.h"
+#include "sweep.h"
+#include "batch.h"
+#include "pfile.h"
+#include "counters.h"
+
+#define SEED 123123
+#define WINDOW (1 << 14)
+#define CHECKPOINT 10000
+
+/* <name>.plinko only ever grows by the particles committed since the last
+ * checkpoint, and <name>.state then records how far it is good for.  The
+ * drops are keyed by (SEED, particle), so that index is all the generator
+ * state there is, and a --resume run carries on from it exactly */
+typedef struct {
+    ullong seed, hash;
+    long next;
+    int prints;
+} t_checkpoint;
+
+typedef struct {
+    double R, damp, wall;
+    t_grid *grid;
+    double *bounces;
+    double *x0;
+    t_pfile *track;
+    char *file_state;
+    ullong hash;
+    int prints;
+
+    // particles come from the sweep, or when it is NULL just 'single'
+    t_sweep *sweep;
+    long single;
+    t_result res;
+
+    t_progress progress;
+} t_plinko;
+
+// the drop of particle i depends only on (SEED, i), not on what ran before
+static void initial_condition(t_plinko *p, long i, double *pos, double *vel){
+    t_rng rng;
+    rng_seed(&rng, SEED, i);
+    pos[0] = p->wall/2 - 0.5 + rng_ran2(&rng);
+    pos[1] = 10.0;
+    vel[0] = 0;
+    vel[1] = 1e-4;
+}
+
+static int next(void *ctx, int wait, long *i, double *pos, double *vel){
+    t_plinko *p = ctx;
+    int got;
+
+    if (p->sweep)
+        got = sweep_next(p->sweep, i, wait);
+    else {
+        got = p->single >= 0;
+        *i = p->single;
+        p->single = -1;
+    }
+
+    if (got == 1)
+        initial_condition(p, *i, pos, vel);
+    return got;
+}
+
+static void done(void *ctx, long i, t_result *res){
+    t_plinko *p = ctx;
+    double pos[2], vel[2];
+
+    if (!p->sweep){
+        p->res = *res;
+        return;
+    }
+
+    initial_condition(p, i, pos, vel);
+    p->bounces[i % WINDOW] = res->nbounces;
+    p->x0[i % WINDOW] = pos[0];
+    sweep_done(p->sweep, i);
+}
+
+static void batch(t_sweep *sweep, void *ctx){
+    t_plinko *p = ctx;
+    (void)sweep;
+    trackCollisionBatch(p->R, p->wall, p->damp, p->grid, next, done, ctx);
+}
+
+static int write_state(const char *filename, t_checkpoint *ck){
+    char tmp[1100];
+    sprintf(tmp, "%s.tmp", filename);
+
+    FILE *file = fopen(tmp, "w");
+    if (!file) return 1;
+    fprintf(file, "seed: %llu\n", ck->seed);
+    fprintf(file, "hash: %016llx\n", ck->hash);
+    fprintf(file, "next: %li\n", ck->next);
+    fprintf(file, "prints: %i\n", ck->prints);
+    fflush(file);
+    fsync(fileno(file));
+    if (fclose(file)) return 1;
+
+    // a crash leaves either the old state or the new one, never half
+    return rename(tmp, filename);
+}
+
+static int read_state(const char *filename, t_checkpoint *ck){
+    FILE *file = fopen(filename, "r");
+    if (!file) return 1;
+    int n = fscanf(file, "seed: %llu hash: %llx next: %li prints: %i",
+            &ck->seed, &ck->hash, &ck->next, &ck->prints);
+    fclose(file);
+    return n != 4;
+}
+
+static int checkpoint(t_plinko *p, long next){
+    // the records go to disk before the state that vouches for them
+    t_checkpoint ck = { SEED, p->hash, next, p->prints };
+    if (pfile_sync(p->track)) return 1;
+    return write_state(p->file_state, &ck);
+}
+
+static int commit(long i, int slot, void *ctx){
+    t_plinko *p = ctx;
+
+    if (i%CHECKPOINT == 0){
+        if (checkpoint(p, i))
+            printf("Could not write checkpoint %s\n", p->file_state);
+        progress_report(&p->progress, i);
+    }
+    pfile_write(p->track, &p->bounces[slot], 1);
+    p->progress.nevents += p->bounces[slot];
+
+    if ((int)p->bounces[slot] % 30 == 0){
+        printf("%li: %f %f | %f %f\n", i, p->x0[slot], 10.0, 0.0, 1e-4);
+        p->prints++;
+        if (p->prints > 100)
+            return 1;
+    }
+    return 0;
+}
+
+static void print_cullstats(void){
+    ullong nsolved = cullstats.ntests - cullstats.nculled - cullstats.nscreened;
+    printf("peg tests: %llu, culled: %llu (%.1f%%), screened: %llu, solved: %llu, hits: %llu\n",
+        cullstats.ntests, cullstats.nculled,
+        100.0*cullstats.nculled / MAX(cullstats.ntests, 1),
+        cullstats.nscreened, nsolved, cullstats.nhits);
+}
 
 int main(int argc, char **argv){
-    if (argc != 2){
-        printf("Incorrect arguments supplied, must be <filename>\n");
+    int shard, nshards;
+    int badshard = sweep_shard_args(&argc, argv, &shard, &nshards);
+    int resume = argc == 3 && strcmp(argv[1], "--resume") == 0;
+    if ((argc != 2 && argc != 3) || badshard){
+        printf("Incorrect arguments supplied, must be <filename> [particle]\n");
+        printf("    or --resume <filename> to continue an interrupted run\n");
+        printf("    with --shard index/nshards (or --shard mpi) to run one part of it\n");
         return 1;
     }
 
-    ran_seed(123123);
     double R = 0.75/2;
     double damp = 1.0;
     double wall = 7;
     char filename[1024];
-    strcpy(filename, argv[1]);
+    strcpy(filename, argv[resume ? 2 : 1]);
 
     char file_track[1024];
-    char file_pegs[1024];
-    char file_conf[1024];
-    sprintf(file_track, "%s.track", filename);
-    sprintf(file_pegs, "%s.pegs", filename);
-    sprintf(file_conf, "%s.conf", filename);
+    char file_state[1024];
+    if (nshards > 1)
+        sprintf(filename + strlen(filename), ".%i-of-%i", shard, nshards);
+    sprintf(file_track, "%s.plinko", filename);
+    sprintf(file_state, "%s.state", filename);
 
     int TIMEPOINTS = 1 << 25;
-    int MAXPEGS = 1 << 10;
-    int npegs = 0;
-    double *pegs = malloc(sizeof(double)*2*MAXPEGS);
-    double *bounces = malloc(sizeof(double)*2*TIMEPOINTS);
-    t_result *res = malloc(sizeof(t_result));
-
-    double pos[2] = { wall / 2 - 0.213, 10.0 };
-    double vel[2] = { 0, 1e-4};
-
-    FILE *file = fopen(file_conf, "w");
-    fprintf(file, "radius: %f\n", R);
-    fprintf(file, "damp: %f\n", damp);
-    fprintf(file, "wall: %f\n", wall);
-    fclose(file);
+    long first, end;
+    sweep_shard(TIMEPOINTS, shard, nshards, &first, &end);
+    t_grid grid;
+    double *bounces = malloc(sizeof(double)*WINDOW);
+    double *x0 = malloc(sizeof(double)*WINDOW);
+
+    build_lattice_grid(&grid, LATTICE_HEX, 4, 8, 0, R);
+    int npegs = grid.npegs;
+    double *pegs = lattice_pegs(&grid);
+
+    // one record per particle, its number of bounces
+    t_pfile_header header = { "", 0, PFILE_BOUNCES, R, damp, wall, 10.0, SEED, 0,
+        TIMEPOINTS, 0, npegs, 0, sizeof(double), 0, 0, 0, shard, nshards > 1 ? nshards : 0, first };
+    ullong hash = pfile_hash(&header, pegs);
+
+    t_plinko plinko = { R, damp, wall, &grid, bounces, x0, NULL, file_state,
+        hash, 0, NULL, -1, {0, 0, 0, 0}, {0, 0, 0} };
+
+    // re-simulate a single particle of the full run, on its own in a batch
+    // since a batch gives any particle the same result
+    if (argc == 3 && !resume){
+        long i = atol(argv[2]);
+        double pos[2], vel[2];
+        initial_condition(&plinko, i, pos, vel);
+        plinko.single = i;
+        trackCollisionBatch(R, wall, damp, &grid, next, done, &plinko);
+        printf("%li: %f %f | %f %f | bounces %i xfinal %f\n",
+            i, pos[0], pos[1], vel[0], vel[1], plinko.res.nbounces, plinko.res.xfinal);
+        COUNTERS_FOLD();
+        COUNTERS_PRINT();
+        return 0;
+    }
 
-    build_hex_grid(pegs, &npegs, MAXPEGS, 4, 8);
-
-    int prints=0;
-    for (int i=0; i<TIMEPOINTS; i++){
-        pos[0] = wall/2 - 0.5 + ran_ran2();
-        pos[1] = 10.0;
-        if (i%10000 == 0){
-            FILE *tfile = fopen(file_track, "wb");
-            fwrite(bounces, sizeof(double), i, tfile);
-            fclose(tfile);
-            printf("%i\n", i);
+    t_checkpoint ck = { SEED, hash, first, 0 };
+    if (resume){
+        if (read_state(file_state, &ck)){
+            printf("Could not read checkpoint %s\n", file_state);
+            return 1;
         }
-        trackCollision(pos, vel, R, wall, damp, pegs, npegs, res);
-        bounces[i] = res->nbounces;
-        if ((int)bounces[i] % 30 == 0){
-            printf("%f %f | %f %f\n", pos[0], pos[1], vel[0], vel[1]);
-            prints++;
-            if (prints > 100)
-                exit(0);
+        if (ck.seed != SEED || ck.hash != hash || ck.next < first || ck.next > end){
+            printf("%s was written with a different configuration\n", file_state);
+            return 1;
+        }
+
+        // drop whatever was appended after the last checkpoint
+        plinko.track = pfile_reopen(file_track, ck.next - first, 1 << 16);
+        if (!plinko.track){
+            printf("Could not reopen %s at %li\n", file_track, ck.next);
+            return 1;
+        }
+        plinko.prints = ck.prints;
+        printf("resuming at %li\n", ck.next);
+    } else {
+        plinko.track = pfile_create(file_track, &header, pegs, 1 << 16);
+        if (!plinko.track){
+            printf("Could not open %s for writing\n", file_track);
+            return 1;
         }
     }
 
-    file = fopen(file_track, "wb");
-    fwrite(bounces, sizeof(double), TIMEPOINTS, file);
-    fclose(file);
+    t_sweep sweep = { ck.next, end, WINDOW, NULL, commit, &plinko, batch, NULL };
+    plinko.sweep = &sweep;
+    progress_start(&plinko.progress, ck.next);
+    long ndone = sweep_run(&sweep);
 
-    file = fopen(file_pegs, "wb");
-    fwrite(pegs, sizeof(double), npegs*2, file);
-    fclose(file);
+    if (checkpoint(&plinko, ndone))
+        printf("Could not write checkpoint %s\n", file_state);
+    if (pfile_close(plinko.track))
+        printf("Error writing %s\n", file_track);
+
+    print_cullstats();
+    COUNTERS_PRINT();
 
+    free_peg_grid(&grid);
+    free(x0);
     free(bounces);
     return 0;
 }
@@ -2,13 +2,16 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
 #include "plinkolib.h"
 #include "roots/quartic.h"
+#include "counters.h"
 
 /*===========================================================================
  *  Some notes:
  *      - the lattice constant for the pegs is the unit, so it is 1
- *      - there will be a 'neighbor' list of pegs instead of pegs near
+ *      - pegs are binned into a uniform cell list (t_grid) and a collision
+ *          query only visits the cells the parabola passes through
  *          ( this will allow us to use very small pegs if we want )
  *      - still thinking about how to add wall friction
  *      - according to PisR, the ratio of the disc to spacing is 3/4
@@ -51,17 +54,66 @@ inline void velocity(double *v0, double t, double *out){
 //============================================================================
 // Cup neighborlist generator - finite and infinite sets
 //============================================================================
-// a square grid of pegs at even grid points
-void pegs_between(double *pos, double *pegs, int *npegs){
-    int i, j;
-    *npegs = 0;
-    for (i=-1; i<=1; i++){
-        for (j=-1; j<=1; j++){
-            pegs[2*(*npegs)+0] = pos[0]-(mymod(pos[0]+1, 2)-1) + 2*i;
-            pegs[2*(*npegs)+1] = pos[1]-(mymod(pos[1]+1, 2)-1) + 2*j;
-            *npegs += 1;
+// the sites of a grid's implicit lattice: sublattice s of rows dy apart,
+// the second one half a spacing across and up, laid out as build_hex_grid
+// does with nothing on the floor
+static double lattice_dy(t_grid *grid){
+    return grid->lattice == LATTICE_HEX ? sqrt(3.0) : 1.0;
+}
+
+static int lattice_nsub(t_grid *grid){
+    return grid->lattice == LATTICE_HEX ? 2 : 1;
+}
+
+static int lattice_site(t_grid *grid, int s, int i, int j){
+    if (i < (s == 0) || i >= grid->rows) return 0;
+    return grid->periodic || (j >= 0 && j < grid->cols - s);
+}
+
+// the index build_hex_grid gives it: by row, column, then sublattice
+static int lattice_id(t_grid *grid, int s, int i, int j){
+    int cols = grid->cols;
+    int across = grid->periodic ? cols : cols - 1;
+    if (grid->periodic) j = (j % cols + cols) % cols;
+
+    if (grid->lattice == LATTICE_SQUARE) return (i-1)*cols + j;
+    if (i == 0) return j;
+    return across + (i-1)*(cols + across) + 2*j + s;
+}
+
+// every lattice peg with its center in the box [lo, hi], in index order.
+// Those a whole period or more across get ids of their own past npegs
+int pegs_between(t_grid *grid, double *lo, double *hi, double *pegs, int *ids){
+    int n = 0, nsub = lattice_nsub(grid);
+    double dy = lattice_dy(grid);
+    int i0[2], i1[2], j0[2], j1[2];
+
+    // the rows and columns of each sublattice inside the box and the board
+    for (int s=0; s<nsub; s++){
+        i0[s] = MAX((int)ceil(lo[1]/dy - 0.5*s), s == 0);
+        i1[s] = MIN((int)floor(hi[1]/dy - 0.5*s), grid->rows-1);
+        j0[s] = (int)ceil(lo[0] - 0.5*s);
+        j1[s] = (int)floor(hi[0] - 0.5*s);
+        if (!grid->periodic){
+            j0[s] = MAX(j0[s], 0);
+            j1[s] = MIN(j1[s], grid->cols-1-s);
+        }
+    }
+
+    for (int i=MIN(i0[0], i0[nsub-1]); i<=MAX(i1[0], i1[nsub-1]); i++){
+        for (int j=MIN(j0[0], j0[nsub-1]); j<=MAX(j1[0], j1[nsub-1]); j++){
+            for (int s=0; s<nsub; s++){
+                if (i < i0[s] || i > i1[s] || j < j0[s] || j > j1[s]) continue;
+                pegs[2*n+0] = j + 0.5*s;
+                pegs[2*n+1] = (i + 0.5*s)*dy;
+                ids[n] = lattice_id(grid, s, i, j);
+                if (grid->periodic)
+                    ids[n] += (int)floor((double)j / grid->cols) * grid->npegs;
+                n++;
+            }
         }
     }
+    return n;
 }
 
 void build_hex_grid(double *pegs, int *npegs, int maxpegs, int rows, int cols){
@@ -90,6 +142,174 @@ void build_hex_grid(double *pegs, int *npegs, int maxpegs, int rows, int cols){
     }
 }
 
+//============================================================================
+// Cell list over a finite set of pegs.  Each peg is entered in every cell
+// that its disc of radius R (plus a little slack for rounding) overlaps, so
+// a ball whose center lies in a cell can only be touching pegs in that cell.
+//============================================================================
+#define GRID_SLACK 1e-6
+
+void build_peg_grid(t_grid *grid, double *pegs, int npegs, double R){
+    int i, c, ix, iy, ix0, ix1, iy0, iy1;
+    double r = R + GRID_SLACK;
+    double xmin=0, xmax=0, ymin=0, ymax=0;
+
+    grid->pegs = pegs;
+    grid->npegs = npegs;
+    grid->lattice = grid->rows = grid->cols = grid->periodic = 0;
+    grid->r = r;
+
+    for (i=0; i<npegs; i++){
+        if (i == 0 || pegs[2*i+0]-r < xmin) xmin = pegs[2*i+0]-r;
+        if (i == 0 || pegs[2*i+0]+r > xmax) xmax = pegs[2*i+0]+r;
+        if (i == 0 || pegs[2*i+1]-r < ymin) ymin = pegs[2*i+1]-r;
+        if (i == 0 || pegs[2*i+1]+r > ymax) ymax = pegs[2*i+1]+r;
+    }
+
+    // about one peg per cell, but never smaller than a peg so that each
+    // peg lands in at most four cells
+    grid->cell = 2*r;
+    if (npegs > 0)
+        grid->cell = MAX(2*r, sqrt((xmax-xmin)*(ymax-ymin)/npegs));
+    grid->x0 = xmin;
+    grid->y0 = ymin;
+    grid->nx = npegs > 0 ? (int)ceil((xmax-xmin)/grid->cell) : 0;
+    grid->ny = npegs > 0 ? (int)ceil((ymax-ymin)/grid->cell) : 0;
+
+    grid->cellstart = calloc(grid->nx*grid->ny+1, sizeof(int));
+    grid->cellpegs = NULL;
+
+    // counting sort of the (cell, peg) pairs, first count then fill
+    for (int pass=0; pass<2; pass++){
+        for (i=0; i<npegs; i++){
+            ix0 = MAX((int)floor((pegs[2*i+0]-r-grid->x0)/grid->cell), 0);
+            ix1 = MIN((int)floor((pegs[2*i+0]+r-grid->x0)/grid->cell), grid->nx-1);
+            iy0 = MAX((int)floor((pegs[2*i+1]-r-grid->y0)/grid->cell), 0);
+            iy1 = MIN((int)floor((pegs[2*i+1]+r-grid->y0)/grid->cell), grid->ny-1);
+
+            for (iy=iy0; iy<=iy1; iy++){
+                for (ix=ix0; ix<=ix1; ix++){
+                    c = iy*grid->nx + ix;
+                    if (pass == 0) grid->cellstart[c+1]++;
+                    else grid->cellpegs[grid->cellstart[c]++] = i;
+                }
+            }
+        }
+
+        if (pass == 0){
+            for (c=0; c<grid->nx*grid->ny; c++)
+                grid->cellstart[c+1] += grid->cellstart[c];
+            grid->cellpegs = malloc(sizeof(int)*(grid->cellstart[grid->nx*grid->ny]+1));
+        } else {
+            // the fill advanced each start to the next cell's start
+            for (c=grid->nx*grid->ny; c>0; c--)
+                grid->cellstart[c] = grid->cellstart[c-1];
+            grid->cellstart[0] = 0;
+        }
+    }
+
+    grid->maxcell = 0;
+    for (c=0; c<grid->nx*grid->ny; c++)
+        grid->maxcell = MAX(grid->maxcell, grid->cellstart[c+1] - grid->cellstart[c]);
+}
+
+void build_lattice_grid(t_grid *grid, int lattice, int rows, int cols,
+        int periodic, double R){
+    double r = R + GRID_SLACK;
+
+    grid->pegs = NULL;
+    grid->cellstart = NULL;
+    grid->cellpegs = NULL;
+    grid->lattice = lattice;
+    grid->rows = rows;
+    grid->cols = cols;
+    grid->periodic = periodic;
+    grid->r = r;
+
+    double dy = lattice_dy(grid);
+    int across = periodic ? cols : cols - 1;
+    if (lattice == LATTICE_SQUARE) grid->npegs = (rows-1)*cols;
+    else grid->npegs = across + (rows-1)*(cols + across);
+
+    // from the lowest row of pegs to the highest, about one lattice
+    // spacing to a cell but never smaller than a peg
+    double ymin = lattice == LATTICE_HEX ? 0.5*dy : dy;
+    double ymax = lattice == LATTICE_HEX ? (rows-0.5)*dy : (rows-1)*dy;
+    grid->cell = MAX(2*r, 1.0);
+    grid->x0 = -r;
+    grid->y0 = ymin - r;
+    grid->nx = (int)ceil((cols-1 + 2*r) / grid->cell);
+    grid->ny = (int)ceil((ymax - ymin + 2*r) / grid->cell);
+
+    // the sites a cell and the reach of a peg around it can hold
+    int span = (int)floor(grid->cell + 2*r) + 2;
+    grid->maxcell = lattice_nsub(grid) * span * ((int)floor((grid->cell + 2*r)/dy) + 2);
+}
+
+double *lattice_pegs(t_grid *grid){
+    // one period across, so a periodic board's are its npegs as well
+    double lo[2] = {0, -1}, hi[2] = {grid->cols - 0.5, grid->rows*2.0};
+    double *pegs = malloc(sizeof(double)*2*grid->npegs);
+    int *ids = malloc(sizeof(int)*grid->npegs);
+    pegs_between(grid, lo, hi, pegs, ids);
+    free(ids);
+    return pegs;
+}
+
+int grid_cell_pegs(t_grid *grid, int ix, int iy, double *pegs, int *ids){
+    if (iy < 0 || iy >= grid->ny) return 0;
+    if (!grid->periodic && (ix < 0 || ix >= grid->nx)) return 0;
+
+    if (grid->lattice){
+        double lo[2] = { grid->x0 + ix*grid->cell - grid->r, grid->y0 + iy*grid->cell - grid->r };
+        double hi[2] = { lo[0] + grid->cell + 2*grid->r, lo[1] + grid->cell + 2*grid->r };
+        return pegs_between(grid, lo, hi, pegs, ids);
+    }
+
+    int c = iy*grid->nx + ix, n = 0;
+    for (int k=grid->cellstart[c]; k<grid->cellstart[c+1]; k++, n++){
+        ids[n] = grid->cellpegs[k];
+        pegs[2*n+0] = grid->pegs[2*ids[n]+0];
+        pegs[2*n+1] = grid->pegs[2*ids[n]+1];
+    }
+    return n;
+}
+
+int grid_peg_index(t_grid *grid, double *peg){
+    // a peg is always listed in the cell that holds its center
+    int i, k;
+
+    if (grid->lattice){
+        double dy = lattice_dy(grid);
+        for (int s=0; s<lattice_nsub(grid); s++){
+            i = (int)floor(peg[1]/dy - 0.5*s + 0.5);
+            k = (int)floor(peg[0] - 0.5*s + 0.5);
+            if (lattice_site(grid, s, i, k) && k + 0.5*s == peg[0] && (i + 0.5*s)*dy == peg[1])
+                return lattice_id(grid, s, i, k);
+        }
+        return -1;
+    }
+
+    int ix = (int)floor((peg[0] - grid->x0) / grid->cell);
+    int iy = (int)floor((peg[1] - grid->y0) / grid->cell);
+    if (ix < 0 || ix >= grid->nx || iy < 0 || iy >= grid->ny) return -1;
+
+    int c = iy*grid->nx + ix;
+    for (k=grid->cellstart[c]; k<grid->cellstart[c+1]; k++){
+        i = grid->cellpegs[k];
+        if (grid->pegs[2*i+0] == peg[0] && grid->pegs[2*i+1] == peg[1])
+            return i;
+    }
+    return -1;
+}
+
+void free_peg_grid(t_grid *grid){
+    free(grid->cellstart);
+    free(grid->cellpegs);
+    grid->cellstart = NULL;
+    grid->cellpegs = NULL;
+}
+
 void collision_normal(double *pos, double h, double *peg, double *out){
     double t[2];
     t[0] = pos[0] - peg[0];
@@ -119,25 +339,70 @@ void reflect_vector(double *vec, double *normal, double *out){
 // finds the collision time for an initial condition
 // by finding the roots of a poly and finding the nearest collision
 //============================================================================
+t_cullstats cullstats = {0, 0, 0, 0};
+#pragma omp threadprivate(cullstats)
+FILE *polycapture = NULL;
+
+int peg_unreachable(double *pos, double *vel, double R,
+        double *peg, double tmax){
+    /*
+     * Conservative test that the ball's center can never come within R of
+     * the peg before tmax.  Returns 1 only when the arc's bounding box over
+     * [0, tmax] misses the peg's, so it never rejects a real collision.
+     */
+    double r = R + GRID_SLACK;
+    double dx = peg[0] - pos[0];
+    double dy = peg[1] - pos[1];
+
+    // above the apex of the parabola
+    if (dy - r > (vel[1] > 0 ? 0.5*vel[1]*vel[1] : 0))
+        return 1;
+
+    // off to the side that the ball is moving away from
+    if (fabs(dx) > r && dx*vel[0] <= 0)
+        return 1;
+
+    if (isinf(tmax))
+        return 0;
+
+    // too far across to reach at constant vx before tmax
+    if (fabs(dx) - r > fabs(vel[0])*tmax)
+        return 1;
+
+    // the arc is concave, so its lowest point on [0, tmax] is an endpoint
+    if (MIN(0, vel[1]*tmax - 0.5*tmax*tmax) > dy + r)
+        return 1;
+
+    return 0;
+}
+
 int collides_with_peg(double *pos, double *vel, double R,
-        double *peg, double *tcoll){
+        double *peg, double tmax, double *tcoll){
     /* 
      * This functions determines whether a particular trajectory collides
      * with the peg specified by h, r, (cx, cy).  It returns:
      *  0 : There was no collision 
      *  1 : There was a collision and it occured at tcoll
-     * It does not modify the values of pos, vel; modified tcoll
+     * It does not modify the values of pos, vel; modified tcoll.  Pegs
+     * that cannot be reached before tmax are rejected without a root solve.
     */
     double poly[DEGSIZE];
-    
+
+    cullstats.ntests++;
+    if (peg_unreachable(pos, vel, R, peg, tmax)){
+        cullstats.nculled++;
+        *tcoll = NAN;
+        return RESULT_NOTHING;
+    }
+
     build_peg_poly(pos, vel, R, peg, poly);
-    *tcoll = bairstow_smallest_root(poly);
-    //*tcoll = durand_kerner_smallest_root(poly);
-    //*tcoll = quartic_exact1_smallest_root(poly);
-    //*tcoll = quartic_exact2_smallest_root(poly);
+    if (polycapture)
+        fwrite(poly, sizeof(double), DEGSIZE, polycapture);
+    *tcoll = SMALLEST_ROOT(poly);
 
     if (isnan(*tcoll))
         return RESULT_NOTHING;
+    cullstats.nhits++;
     return RESULT_COLLISION;
 }
 
@@ -150,7 +415,7 @@ int earliest_peg_collision(double *pos, double *vel, double R,
     tevent = NAN;
 
     for (i=0; i<npegs; i++){
-        result = collides_with_peg(pos, vel, R, &pegs[2*i], tcoll);
+        result = collides_with_peg(pos, vel, R, &pegs[2*i], INFINITY, tcoll);
         if (result == RESULT_COLLISION){
             if ((isnan(tevent) || tevent > *tcoll) && *tcoll > 0){
                 peg[0] = pegs[2*i+0];
@@ -164,26 +429,126 @@ int earliest_peg_collision(double *pos, double *vel, double R,
     return event;
 }
 
-int next_collision(double *pos, double *vel, double R,
-        double *pegs, double npegs, double wall, double *tcoll, double *peg){
-    int result;
+//============================================================================
+// Walk of the ball's center through the cells of the grid in time order.
+// walk_cell gives the cell the walk is in (or -1 off the grid) along with
+// the time tnext that the center leaves it, walk_advance steps into the
+// next cell and returns 0 once the arc can never come back to the grid.
+//============================================================================
+void walk_start(t_walk *walk, double *pos, t_grid *grid){
+    walk->ix = (int)floor((pos[0] - grid->x0) / grid->cell);
+    walk->iy = (int)floor((pos[1] - grid->y0) / grid->cell);
+    walk->t = 0;
+}
+
+int walk_cell(t_walk *walk, double *pos, double *vel, t_grid *grid){
+    double ylo, yhi, desc;
+    int ix = walk->ix, iy = walk->iy;
+
+    // time the center leaves this cell through a side
+    walk->tx = INFINITY;
+    if (vel[0] > 0) walk->tx = (grid->x0 + (ix+1)*grid->cell - pos[0]) / vel[0];
+    if (vel[0] < 0) walk->tx = (grid->x0 + ix*grid->cell - pos[0]) / vel[0];
+
+    // through the top on the way up if the apex clears it, otherwise
+    // through the bottom on the way down
+    ylo = grid->y0 + iy*grid->cell;
+    yhi = ylo + grid->cell;
+    walk->up = 0;
+    desc = vel[1]*vel[1] + 2*(pos[1] - yhi);
+    if (desc > 0 && vel[1] - sqrt(desc) > walk->t){
+        walk->ty = vel[1] - sqrt(desc);
+        walk->up = 1;
+    } else {
+        desc = vel[1]*vel[1] + 2*(pos[1] - ylo);
+        walk->ty = vel[1] + sqrt(MAX(desc, 0));
+    }
+    walk->tnext = MIN(walk->tx, walk->ty);
+
+    if (ix >= 0 && ix < grid->nx && iy >= 0 && iy < grid->ny)
+        return iy*grid->nx + ix;
+    return -1;
+}
+
+int walk_advance(t_walk *walk, double *vel, t_grid *grid){
+    if (walk->tx < walk->ty) walk->ix += vel[0] > 0 ? 1 : -1;
+    else                     walk->iy += walk->up ? 1 : -1;
+    walk->t = walk->tnext;
+
+    // the arc never comes back to the grid, which a periodic one has no
+    // sides to leave by
+    if (!grid->periodic && walk->ix < 0 && vel[0] <= 0) return 0;
+    if (!grid->periodic && walk->ix >= grid->nx && vel[0] >= 0) return 0;
+    if (walk->iy < 0 && vel[1] - walk->t <= 0) return 0;
+    return 1;
+}
+
+int earliest_grid_collision(double *pos, double *vel, double R,
+        t_grid *grid, double tmax, double *tcoll, double *peg){
+    /*
+     * Same answer as earliest_peg_collision, but only for the pegs in the
+     * cells that the ball's center passes through, in time order.  The walk
+     * stops at the first cell whose exit time is after the best hit found
+     * so far, or once the arc is past tmax or can no longer reach the grid.
+     */
+    int i, k, n, ntested, seen;
+    int tested[GRID_MAXTESTED];
+    int ids[MAX(grid->maxcell, 1)];
+    double cellpegs[2*MAX(grid->maxcell, 1)];
+    double tpeg, tlimit, tevent;
+    t_walk walk;
+
     int event = RESULT_NOTHING;
-    double tevent = NAN, twall = 0;
+    tevent = NAN;
+    ntested = 0;
 
-    result = earliest_peg_collision(pos, vel, R, pegs, npegs, tcoll, peg);
-    if (result == RESULT_COLLISION){
-        if ((isnan(tevent) || tevent > *tcoll) && *tcoll > 0){
-            event = result;
-            tevent = *tcoll;
+    walk_start(&walk, pos, grid);
+    while (1){
+        walk_cell(&walk, pos, vel, grid);
+        n = grid_cell_pegs(grid, walk.ix, walk.iy, cellpegs, ids);
+        for (k=0; k<n; k++){
+            i = ids[k];
+
+            // pegs straddling cells are met again in the next cell
+            seen = 0;
+            for (int j=0; j<ntested; j++)
+                if (tested[j] == i) seen = 1;
+            if (seen) continue;
+            if (ntested < GRID_MAXTESTED) tested[ntested++] = i;
+
+            // nothing after the best hit so far can matter either
+            tlimit = isnan(tevent) ? tmax : MIN(tmax, tevent);
+            if (collides_with_peg(pos, vel, R, &cellpegs[2*k], tlimit, &tpeg) == RESULT_COLLISION){
+                if ((isnan(tevent) || tevent > tpeg) && tpeg > 0){
+                    peg[0] = cellpegs[2*k+0];
+                    peg[1] = cellpegs[2*k+1];
+                    event = RESULT_COLLISION;
+                    tevent = tpeg;
+                }
+            }
         }
+
+        // anything found further along happens after this hit
+        if (!isnan(tevent) && tevent <= walk.tnext) break;
+        if (walk.tnext > tmax) break;
+        if (!walk_advance(&walk, vel, grid)) break;
     }
 
-    twall = -pos[0] / vel[0];
+    *tcoll = tevent;
+    return event;
+}
+
+int next_wall_collision(double *pos, double *vel, double wall, double *tcoll){
+    /* a wall of 0 or less has no sides, for periodic boards */
+    int event = RESULT_NOTHING;
+    double tevent = NAN, twall = NAN;
+
+    if (wall > 0) twall = -pos[0] / vel[0];
     if (!isnan(twall) && (isnan(tevent) || tevent > twall) && twall > 0){
         event = RESULT_WALL_LEFT; tevent = twall;
     }
 
-    twall = (wall-pos[0]) / vel[0];
+    if (wall > 0) twall = (wall-pos[0]) / vel[0];
     if (!isnan(twall) && (isnan(tevent) || tevent > twall) && twall > 0){
         event = RESULT_WALL_RIGHT; tevent = twall;
     }
@@ -197,6 +562,30 @@ int next_collision(double *pos, double *vel, double R,
     return event;
 }
 
+int next_collision(double *pos, double *vel, double R,
+        t_grid *grid, double wall, double *tcoll, double *peg){
+    int result, event;
+    double tevent;
+    COUNT_START(start);
+
+    event = next_wall_collision(pos, vel, wall, &tevent);
+
+    // the walls and floor bound how far along the arc pegs need checking,
+    // a peg wins ties with them
+    result = earliest_grid_collision(pos, vel, R, grid,
+            isnan(tevent) ? INFINITY : tevent, tcoll, peg);
+    if (result == RESULT_COLLISION){
+        if ((isnan(tevent) || tevent >= *tcoll) && *tcoll > 0){
+            event = result;
+            tevent = *tcoll;
+        }
+    }
+
+    *tcoll = tevent;
+    COUNT_CYCLES(collision, start);
+    return event;
+}
+
 double zero_cross_time(double *p, double *v){
     double a = -1./2;
     double b = v[1];
@@ -225,128 +614,330 @@ void create_norm(double *peg, double *pos, double *out){
     out[1] /= len;
 }
 
-int trackCollision(double *pos, double *vel, double R, double wall,
-        double damp, double *pegs, int npegs, t_result *out){
+int apply_event(double *pos, double *vel, double damp, int result,
+        double tcoll, double *peg){
+    /*
+     * Moves the ball along its arc to the event found by next_collision
+     * and bounces it.  Returns 0 when that ends the particle instead, in
+     * which case for RESULT_DONE pos is where it reached the floor.
+     */
+    double vlen, norm[2];
+
+    COUNT(events[result]);
+    if (result == RESULT_NOTHING) return 0;
+    if (result == RESULT_DONE){
+        position(pos, vel, tcoll, pos);
+        return 0;
+    }
+
+    // figure out where it hit and what speed
+    position(pos, vel, tcoll, pos);
+    velocity(vel, tcoll, vel);
+    vlen = dot(vel, vel);
+
+    if (pos[1] < 0 || vlen < EPS) return 0;
+    if (result == RESULT_WALL_LEFT)  vel[0] *= -1;
+    if (result == RESULT_WALL_RIGHT) vel[0] *= -1;
+    if (result == RESULT_COLLISION){
+        create_norm(peg, pos, norm); 
+        reflect_vector(vel, norm, vel);
+    }
+
+    position(pos, vel, EPS, pos); 
+    velocity(vel, EPS, vel);
+    vel[0] *= damp;
+    vel[1] *= damp;
+    return 1;
+}
+
+int trackBounces(double *pos, double *vel, double R, double wall,
+        double damp, t_grid *grid, int maxbounces, t_result *out){
     int result;
-    int clen = 0;
-    double tcoll, vlen;
+    double tcoll, peg[2];
+
+    peg[0] = peg[1] = 0.0;
+    out->time_total = 0;
+    out->xfinal = NAN;
+    int tbounces = 0;
+    while (tbounces < maxbounces){
+        result = next_collision(pos, vel, R, grid, wall, &tcoll, peg);
+        if (result != RESULT_NOTHING) out->time_total += tcoll;
+        if (!apply_event(pos, vel, damp, result, tcoll, peg)){
+            if (result == RESULT_DONE) out->xfinal = pos[0];
+            break;
+        }
+        out->time_total += EPS;
+        tbounces++;
+    }
 
-    double tpos[2], tvel[2], peg[2], norm[2]; 
+    out->nbounces = tbounces;
+    return tbounces;
+}
+
+int trackCollision(double *pos, double *vel, double R, double wall,
+        double damp, t_grid *grid, t_result *out){
+    double tpos[2], tvel[2];
     memcpy(tpos, pos, sizeof(double)*2);
     memcpy(tvel, vel, sizeof(double)*2);
 
+    trackBounces(tpos, tvel, R, wall, damp, grid, MAXBOUNCES, out);
+    return 0;
+}
+
+//============================================================================
+// Tangent map: how a small change d(x, y, vx, vy) of the state is carried
+// along by the arcs and bounces of the flight
+//============================================================================
+static void tangent_flight(double *d, double t){
+    d[0] += d[2]*t;
+    d[1] += d[3]*t;
+}
+
+static void tangent_bounce(double *d, double *vin, double *vout,
+        double *norm, double curv){
+    /*
+     * d from just before a bounce to just after, at the time the
+     * unperturbed ball bounces.  The perturbed one bounces dt later, at a
+     * point dp along the surface where the normal has turned by curv*dp
+     * (1/R for a peg, 0 for a wall).  Gravity is (0, -1).
+     */
+    double nv = dot(norm, vin);
+    double dt = -(norm[0]*d[0] + norm[1]*d[1]) / nv;
+
+    double dp[2] = { d[0] + vin[0]*dt, d[1] + vin[1]*dt };
+    double dv[2] = { d[2], d[3] - dt };
+    double dn[2] = { curv*dp[0], curv*dp[1] };
+
+    // the change of v - 2 (v.n) n, in v and in n
+    double ndv = dot(norm, dv), dnv = dot(dn, vin);
+    double vx = dv[0] - 2*(ndv*norm[0] + dnv*norm[0] + nv*dn[0]);
+    double vy = dv[1] - 2*(ndv*norm[1] + dnv*norm[1] + nv*dn[1]);
+
+    d[0] = dp[0] - vout[0]*dt;
+    d[1] = dp[1] - vout[1]*dt;
+    d[2] = vx;
+    d[3] = vy + dt;
+}
+
+int trackLyapunov(double *pos, double *vel, double R, double wall,
+        double damp, t_grid *grid, int maxbounces, t_result *out,
+        t_lyapunov *ly, t_sink *sink){
+    int result, live, more = 1;
+    double tcoll, peg[2], hit[2], vin[2], vout[2], norm[2], curv, len;
+    double *d = ly->tangent;
+
     peg[0] = peg[1] = 0.0;
+    out->time_total = 0;
+    out->xfinal = NAN;
     int tbounces = 0;
-    while (tbounces < MAXBOUNCES){
-        result = next_collision(tpos, tvel, R, pegs, npegs, wall, &tcoll, peg);
-
+    while (tbounces < maxbounces && more){
+        result = next_collision(pos, vel, R, grid, wall, &tcoll, peg);
         if (result == RESULT_NOTHING) break;
-        if (result == RESULT_DONE){
-            position(tpos, tvel, tcoll, tpos);
-            out->xfinal = tpos[0];
-            break;
-        }
 
-        // figure out where it hit and what speed
-        position(tpos, tvel, tcoll, tpos);
-        velocity(tvel, tcoll, tvel);
-        vlen = dot(tvel, tvel);
+        position(pos, vel, tcoll, hit);
+        velocity(vel, tcoll, vin);
+        tangent_flight(d, tcoll);
+        out->time_total += tcoll;
+        live = apply_event(pos, vel, damp, result, tcoll, peg);
 
-        if (tpos[1] < 0 || vlen < EPS) break;
-        if (result == RESULT_WALL_LEFT)  tvel[0] *= -1;
-        if (result == RESULT_WALL_RIGHT) tvel[0] *= -1;
-        if (result == RESULT_COLLISION){
-            create_norm(peg, tpos, norm); 
-            reflect_vector(tvel, norm, tvel);
-        }
+        if (live){
+            if (result == RESULT_COLLISION){
+                create_norm(peg, hit, norm);
+                reflect_vector(vin, norm, vout);
+                curv = 1 / sqrt((hit[0]-peg[0])*(hit[0]-peg[0]) + (hit[1]-peg[1])*(hit[1]-peg[1]));
+            } else {
+                norm[0] = 1; norm[1] = 0;
+                vout[0] = -vin[0]; vout[1] = vin[1];
+                curv = 0;
+            }
+            tangent_bounce(d, vin, vout, norm, curv);
+            tangent_flight(d, EPS);
+            d[2] *= damp;
+            d[3] *= damp;
+            out->time_total += EPS;
+            tbounces++;
+        } else if (result == RESULT_DONE)
+            out->xfinal = pos[0];
 
-        position(tpos, tvel, EPS, tpos); 
-        velocity(tvel, EPS, tvel);
-        tvel[0] *= damp;
-        tvel[1] *= damp;
-        tbounces++;
+        // the last arc too, so that every bit of time_total has its stretch
+        len = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2] + d[3]*d[3]);
+        ly->sumlog += log(len);
+        for (int k=0; k<4; k++) d[k] /= len;
+
+        if (sink){
+            double rec[2] = { out->time_total, ly->sumlog };
+            more = sink_put(sink, rec);
+        }
+        if (!live) break;
     }
 
+    if (sink && sink->n > 0)
+        sink->flush(sink);
+
     out->nbounces = tbounces;
-    return 2*clen;
+    return tbounces;
+}
+
+static int trajectory_bounce(double *pos, double *vel, double R, double damp,
+        int result, double tcoll, double *peg, double *hit){
+    /*
+     * The bounce of trackTrajectory and trackEvents, which unlike
+     * apply_event keeps the ball off the peg with apply_constraint.  Leaves
+     * the point it hit in hit, returns 0 if the flight ends there instead.
+     */
+    double vlen, norm[2];
+
+    // figure out where it hit and what speed
+    position(pos, vel, tcoll, pos);
+    velocity(vel, tcoll, vel);
+    vlen = dot(vel, vel);
+
+    // react to the collision
+    if (pos[1] < 0 || vlen < EPS) return 0;
+    if (result == RESULT_WALL_LEFT)  vel[0] *= -1;
+    if (result == RESULT_WALL_RIGHT) vel[0] *= -1;
+    if (result == RESULT_COLLISION){
+        create_norm(peg, pos, norm);
+        reflect_vector(vel, norm, vel);
+        apply_constraint(peg, R, pos, norm);
+    }
+    memcpy(hit, pos, sizeof(double)*2);
+
+    position(pos, vel, EPS, pos);
+    velocity(vel, EPS, vel);
+    vel[0] *= damp;
+    vel[1] *= damp;
+    return 1;
+}
+
+int sink_put(t_sink *sink, const void *record){
+    memcpy(sink->buf + sink->n*sink->record, record, sink->record);
+    if (++sink->n < sink->size) return 1;
+    return sink->flush(sink);
 }
 
-int trackTrajectory(double *pos, double *vel, double R, double wall,
-        double damp, double *pegs, int npegs, t_result *out, int NT, double *traj,
+long trackTrajectory(double *pos, double *vel, double R, double wall,
+        double damp, t_grid *grid, t_result *out, t_sink *sink,
         int constant_interval, double tinterval){
-    int result;
-    int clen = 0;
-    double tcoll=0.0, vlen=0.0, tlastbounce=0.0, tlastsave=0.0, temp_lastsave=0.0, tint;
+    int result, stop = 0;
+    long npoints = 0;
+    double tcoll=0.0, tlastbounce=0.0, tlastsave=0.0, temp_lastsave=0.0, tint;
 
     //double timereal = 0.0, timesave = 0.0;
 
-    double tpos[2], tvel[2], peg[2], ttpos[2], norm[2]; 
+    double tpos[2], tvel[2], peg[2], ttpos[2], hit[2];
     memcpy(tpos, pos, sizeof(double)*2);
     memcpy(tvel, vel, sizeof(double)*2);
 
     peg[0] = peg[1] = 0.0;
     int tbounces = 0;
-    while (tbounces < MAXBOUNCES){
-        result = next_collision(tpos, tvel, R, pegs, npegs, wall, &tcoll, peg);
+    while (tbounces < MAXBOUNCES && !stop){
+        result = next_collision(tpos, tvel, R, grid, wall, &tcoll, peg);
+        COUNT(events[result]);
 
         tint = constant_interval ? tinterval : tcoll/TSAMPLES;
-        for (double t=tlastsave+tint; t<(tlastbounce+tcoll); t+=tint){
+        for (double t=tlastsave+tint; sink && !stop && t<(tlastbounce+tcoll); t+=tint){
             position(tpos, tvel, t-tlastbounce, ttpos);
-            if (NT >= 0 && clen < NT/2-2){
-                temp_lastsave = t;
-                memcpy(traj+2*clen, ttpos, sizeof(double)*2);
-                clen += 1;
-            }
+            temp_lastsave = t;
+            stop = !sink_put(sink, ttpos);
+            npoints++;
         }
         tlastsave = temp_lastsave;
 
+        if (stop) break;
         if (result == RESULT_NOTHING) break;
         if (result == RESULT_DONE)    break;
 
-        // figure out where it hit and what speed
-        position(tpos, tvel, tcoll, tpos);
-        velocity(tvel, tcoll, tvel);
-        vlen = dot(tvel, tvel);
-
         tlastbounce = tlastbounce + tcoll;
+        if (!trajectory_bounce(tpos, tvel, R, damp, result, tcoll, peg, hit)) break;
 
-        // react to the collision
-        if (tpos[1] < 0 || vlen < EPS) break;
-        if (result == RESULT_WALL_LEFT)  tvel[0] *= -1;
-        if (result == RESULT_WALL_RIGHT) tvel[0] *= -1;
-        if (result == RESULT_COLLISION){
-            create_norm(peg, tpos, norm); 
-            reflect_vector(tvel, norm, tvel);
-            apply_constraint(peg, R, tpos, norm);
-
-            // display the collision normals in the trajectory
-            /*if (NT >= 0 && clen < NT/2-6){
-                memcpy(ttpos, tpos, sizeof(double)*2);
-                ttpos[0] -= R*norm[0]; ttpos[1] -= R*norm[1];
-                memcpy(traj+2*clen, tpos, sizeof(double)*2); clen += 1;
-                memcpy(traj+2*clen, ttpos, sizeof(double)*2); clen += 1;
-                memcpy(traj+2*clen, tpos, sizeof(double)*2); clen += 1;
-            }*/
+        // if we are not doing constant interval saving, save the hit point
+        if (!constant_interval && sink){
+            tlastsave = tlastbounce;
+            stop = !sink_put(sink, hit);
+            npoints++;
         }
+        tbounces++;
+    }
 
-        // if we are not doing constant interval saving, save the hit point
-        if (!constant_interval){
-            if (NT >= 0 && clen < NT/2-2){
-                tlastsave = tlastbounce;
-                memcpy(traj+2*clen, tpos, sizeof(double)*2);
-                clen += 1;
-            }
+    if (sink && sink->n > 0)
+        sink->flush(sink);
+
+    out->time_total = tlastbounce + (result == RESULT_DONE ? tcoll : 0);
+    out->nbounces = tbounces;
+    return npoints;
+}
+
+//============================================================================
+// Event log: the same flight as trackTrajectory, but only the state after
+// each event is kept and the arcs between them are left to event_position
+//============================================================================
+static int log_event(t_sink *sink, long *nevents, double t,
+        double *pos, double *vel, int type, int peg){
+    t_event e;
+    e.t = t;
+    memcpy(e.pos, pos, sizeof(double)*2);
+    memcpy(e.vel, vel, sizeof(double)*2);
+    e.type = type;
+    e.peg = peg;
+    (*nevents)++;
+    return sink_put(sink, &e);
+}
+
+long trackEvents(double *pos, double *vel, double R, double wall,
+        double damp, t_grid *grid, t_result *out, t_sink *sink){
+    int result, more;
+    long nevents = 0;
+    double tcoll = 0.0, tlastbounce = 0.0;
+
+    double tpos[2], tvel[2], peg[2], hit[2];
+    memcpy(tpos, pos, sizeof(double)*2);
+    memcpy(tvel, vel, sizeof(double)*2);
+
+    peg[0] = peg[1] = 0.0;
+    int tbounces = 0;
+    more = log_event(sink, &nevents, 0.0, tpos, tvel, RESULT_NOTHING, -1);
+
+    while (tbounces < MAXBOUNCES && more){
+        result = next_collision(tpos, tvel, R, grid, wall, &tcoll, peg);
+        COUNT(events[result]);
+        if (result == RESULT_NOTHING) break;
+
+        // the flight ends here, log where so that its last arc is bounded
+        tlastbounce = tlastbounce + tcoll;
+        if (result == RESULT_DONE){
+            position(tpos, tvel, tcoll, hit);
+            velocity(tvel, tcoll, tvel);
+            log_event(sink, &nevents, tlastbounce, hit, tvel, result, -1);
+            break;
         }
 
-        position(tpos, tvel, EPS, tpos); 
-        velocity(tvel, EPS, tvel);
-        tvel[0] *= damp;
-        tvel[1] *= damp;
+        if (!trajectory_bounce(tpos, tvel, R, damp, result, tcoll, peg, hit)){
+            log_event(sink, &nevents, tlastbounce, tpos, tvel, result, -1);
+            break;
+        }
+        more = log_event(sink, &nevents, tlastbounce, tpos, tvel, result,
+                result == RESULT_COLLISION ? grid_peg_index(grid, peg) : -1);
         tbounces++;
     }
 
+    if (sink->n > 0)
+        sink->flush(sink);
+
+    out->time_total = tlastbounce;
     out->nbounces = tbounces;
-    return 2*clen;
+    return nevents;
+}
+
+void event_position(t_event *events, int nevents, double t, double *out){
+    // the last event at or before t, or the first if t is before them all
+    int lo = 0, hi = nevents-1, mid;
+    while (lo < hi){
+        mid = (lo + hi + 1) / 2;
+        if (events[mid].t <= t) lo = mid;
+        else hi = mid - 1;
+    }
+    position(events[lo].pos, events[lo].vel, t - events[lo].t, out);
 }
 
 void apply_constraint(double *peg, double R, double *pos, double *norm){
@@ -361,20 +952,74 @@ void apply_constraint(double *peg, double R, double *pos, double *norm){
     pos[1] -= excess*norm[1];
 }
 
-ullong vseed;
-ullong vran;
+//============================================================================
+// Counter based generator (Philox4x32-10, Salmon et al. 2011).  Draw d of
+// particle i under a seed is a pure function of (seed, i, d), so any
+// particle's random numbers can be regenerated without replaying the others
+//============================================================================
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+void philox4x32(uint32_t *ctr, uint32_t *key, uint32_t *out){
+    uint32_t c[4], k[2];
+    uint64_t p0, p1;
+    memcpy(c, ctr, sizeof(c));
+    memcpy(k, key, sizeof(k));
 
-void ran_seed(long j){
-  vseed = j;  vran = 4101842887655102017LL;
-  vran ^= vseed; 
-  vran ^= vran >> 21; vran ^= vran << 35; vran ^= vran >> 4;
-  vran = vran * 2685821657736338717LL;
+    for (int r=0; r<10; r++){
+        p0 = (uint64_t)PHILOX_M0 * c[0];
+        p1 = (uint64_t)PHILOX_M1 * c[2];
+        c[0] = (uint32_t)(p1 >> 32) ^ c[1] ^ k[0];
+        c[1] = (uint32_t)p1;
+        c[2] = (uint32_t)(p0 >> 32) ^ c[3] ^ k[1];
+        c[3] = (uint32_t)p0;
+        k[0] += PHILOX_W0;
+        k[1] += PHILOX_W1;
+    }
+    memcpy(out, c, sizeof(c));
+}
+
+double rng_draw(ullong seed, ullong particle, ullong draw){
+    uint32_t ctr[4] = { (uint32_t)particle, (uint32_t)(particle >> 32),
+                        (uint32_t)draw, (uint32_t)(draw >> 32) };
+    uint32_t key[2] = { (uint32_t)seed, (uint32_t)(seed >> 32) };
+    uint32_t out[4];
+
+    philox4x32(ctr, key, out);
+
+    // top 53 bits give every double in [0, 1) on a grid of 2^-53
+    ullong bits = ((ullong)out[0] << 32 | out[1]) >> 11;
+    return bits * 1.1102230246251565404e-16;
+}
+
+void rng_seed(t_rng *rng, ullong seed, ullong particle){
+    rng->seed = seed;
+    rng->particle = particle;
+    rng->draw = 0;
 }
 
-double ran_ran2(){
-    vran ^= vran >> 21; vran ^= vran << 35; vran ^= vran >> 4;
-    ullong t = vran * 2685821657736338717LL;
-    return 5.42101086242752217e-20*t;
+double rng_ran2(t_rng *rng){
+    return rng_draw(rng->seed, rng->particle, rng->draw++);
 }
 
+t_rng vran;
 
+void ran_seed(long j){ rng_seed(&vran, j, 0); }
+double ran_ran2(){ return rng_ran2(&vran); }
+
+//============================================================================
+// FNV-1a over raw bytes, chained through 'hash' so that a run's settings can
+// be folded in one at a time into one fingerprint of its configuration
+//============================================================================
+#define FNV_PRIME 0x100000001b3ULL
+
+ullong hash_bytes(ullong hash, const void *data, size_t nbytes){
+    const unsigned char *c = data;
+    for (size_t i=0; i<nbytes; i++){
+        hash ^= c[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
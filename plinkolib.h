@@ -1,6 +1,10 @@
 #ifndef __PLINKO_H__
 #define __PLINKO_H__
 
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
 //========================================================
 // global constants for the calculation
 //========================================================
@@ -27,18 +31,157 @@ typedef struct {
     int nbounces;
 } t_result;
 
+/* uniform cell list over the board; each cell lists every peg whose disc
+ * of radius R overlaps it, so a ball centred in the cell can only touch
+ * those pegs.  With lattice set there is no peg list at all: the pegs are
+ * the sites of rows x cols unit cells of that lattice, worked out for each
+ * cell as it is needed, and a periodic one repeats every cols across
+ * without end.  maxcell bounds the pegs of any one cell either way */
+#define LATTICE_HEX    1
+#define LATTICE_SQUARE 2
+
+typedef struct {
+    double *pegs;
+    int npegs;
+
+    double x0, y0, cell;
+    int nx, ny;
+    int *cellstart;
+    int *cellpegs;
+
+    int lattice, rows, cols, periodic;
+    double r;
+    int maxcell;
+} t_grid;
+
+/* where a walk of the ball's center through the cells of a t_grid is:
+ * cell (ix, iy) entered at time t, left at tnext = MIN(tx, ty) */
+typedef struct {
+    int ix, iy, up;
+    double t, tx, ty, tnext;
+} t_walk;
+
+/* pegs remembered per query so that one met again in a neighbouring cell
+ * is only tested once */
+#define GRID_MAXTESTED 64
+
 typedef unsigned long long int ullong;
+
+/* where a trajectory's records go as they are made.  sink_put copies one
+ * into buf, and once size of them are there flush(sink) hands buf[0..n)
+ * on, leaves n at 0 (buf may move) and returns 0 to end the trajectory.
+ * The tracking functions flush what is left before they return.  See
+ * sink.h for ready made sinks, which also set close */
+typedef struct t_sink t_sink;
+struct t_sink {
+    char *buf;
+    size_t record;
+    long size, n;
+    int (*flush)(t_sink *sink);
+    int (*close)(t_sink *sink);
+    void *ctx;
+};
+
+/* one entry of an event log: the ball's state just after event 'type'
+ * (a RESULT_*, with the index of the peg for RESULT_COLLISION, otherwise
+ * -1) at time t, from which it flies on an arc to the next entry.  The
+ * first entry is the drop, the last is where the flight ends */
+typedef struct {
+    double t;
+    double pos[2], vel[2];
+    int type, peg;
+} t_event;
+
+/* how many peg tests were settled by peg_unreachable instead of the
+ * root solver, how many more the batch engine's float screen settled,
+ * and how many solves found a root */
+typedef struct {
+    ullong ntests;
+    ullong nculled;
+    ullong nscreened;
+    ullong nhits;
+} t_cullstats;
+
+extern t_cullstats cullstats;
+#pragma omp threadprivate(cullstats)
+
+/* when set, every polynomial handed to the root solver is appended here
+ * as DEGSIZE raw doubles (see roots/bench.c) */
+extern FILE *polycapture;
+/* position in the counter based stream of one particle: draw number
+ * 'draw' of 'particle' under 'seed'.  ran_seed/ran_ran2 walk particle 0
+ * of a global one */
+typedef struct {
+    ullong seed;
+    ullong particle;
+    ullong draw;
+} t_rng;
+
+void   philox4x32(uint32_t *ctr, uint32_t *key, uint32_t *out);
+double rng_draw(ullong seed, ullong particle, ullong draw);
+void   rng_seed(t_rng *rng, ullong seed, ullong particle);
+double rng_ran2(t_rng *rng);
 void   ran_seed(long j);
 double ran_ran2();
 
+/* fingerprint of a run's settings, start from HASH_INIT */
+#define HASH_INIT 0xcbf29ce484222325ULL
+ullong hash_bytes(ullong hash, const void *data, size_t nbytes);
+
 //========================================================
 /* These are functions that should be called externally */
 int trackCollision(double *pos, double *vel, double R, double wall,
-        double damp, double *pegs, int npegs, t_result *out);
-int trackTrajectory(double *pos, double *vel, double R, double wall,
-        double damp, double *pegs, int npegs, t_result *out, int NT, double *traj,
+        double damp, t_grid *grid, t_result *out);
+/* trackCollision for at most maxbounces bounces, moving pos, vel along to
+ * just after the last one.  Returns the bounces made, fewer than
+ * maxbounces only if the flight ended first */
+int trackBounces(double *pos, double *vel, double R, double wall,
+        double damp, t_grid *grid, int maxbounces, t_result *out);
+/* (x, y) points of the flight into sink (none if it is NULL) every tinterval
+ * or TSAMPLES per arc plus each hit, returns how many were put */
+long trackTrajectory(double *pos, double *vel, double R, double wall,
+        double damp, t_grid *grid, t_result *out, t_sink *sink,
         int constant_interval, double tinterval);
 
+/* the flight as t_event records into sink, returns how many were logged */
+long trackEvents(double *pos, double *vel, double R, double wall,
+        double damp, t_grid *grid, t_result *out, t_sink *sink);
+
+/* a tangent vector d(x, y, vx, vy) to a flight, kept at unit length, and
+ * the log of how much it has been stretched in all */
+typedef struct {
+    double tangent[4];
+    double sumlog;
+} t_lyapunov;
+
+/* trackBounces that carries ly->tangent along the flight, through each
+ * arc and each bounce (with the change in when the bounce happens), and
+ * renormalises it after every event.  ly->sumlog / time_total is then the
+ * flight's finite time Lyapunov exponent.  With a sink, (t, sumlog) goes
+ * to it after every event, the running exponent being sumlog / t */
+int trackLyapunov(double *pos, double *vel, double R, double wall,
+        double damp, t_grid *grid, int maxbounces, t_result *out,
+        t_lyapunov *ly, t_sink *sink);
+
+int  sink_put(t_sink *sink, const void *record);
+/* where a logged flight is at time t */
+void event_position(t_event *events, int nevents, double t, double *out);
+
+void build_peg_grid(t_grid *grid, double *pegs, int npegs, double R);
+/* the same board as build_hex_grid (or its square counterpart) makes, in
+ * constant memory whatever its size */
+void build_lattice_grid(t_grid *grid, int lattice, int rows, int cols,
+        int periodic, double R);
+/* a lattice grid's npegs pegs in index order (x, y pairs, to be freed),
+ * for the files that record the board and anything that wants a list */
+double *lattice_pegs(t_grid *grid);
+void free_peg_grid(t_grid *grid);
+/* index of the peg centered at peg, -1 if there is none */
+int  grid_peg_index(t_grid *grid, double *peg);
+/* the pegs of cell (ix, iy) into pegs (x, y pairs) with an id for each
+ * that no other peg met on one arc shares, returns how many */
+int  grid_cell_pegs(t_grid *grid, int ix, int iy, double *pegs, int *ids);
+
 //========================================================
 /* internal use functions only */
 double polyeval(double *poly, int deg, double x);
@@ -57,16 +200,27 @@ void position(double *x0, double *v0, double t, double *out);
 void velocity(double *v0, double t, double *out);
 
 void build_hex_grid(double *pegs, int *npegs, int maxpegs, int rows, int cols);
+int  pegs_between(t_grid *grid, double *lo, double *hi, double *pegs, int *ids);
 void reflect_vector(double *vec, double *normal, double *out);
 void collision_normal(double *pos, double h, double *peg, double *out);
 void apply_constraint(double *peg, double R, double *pos, double *norm);
 
+int peg_unreachable(double *pos, double *vel, double R,
+        double *peg, double tmax);
 int collides_with_peg(double *pos, double *vel, double R,
-        double *peg, double *tcoll);
+        double *peg, double tmax, double *tcoll);
 int earliest_peg_collision(double *pos, double *vel, double R,
         double *pegs, int npegs, double *tcoll, double *peg);
+void walk_start(t_walk *walk, double *pos, t_grid *grid);
+int walk_cell(t_walk *walk, double *pos, double *vel, t_grid *grid);
+int walk_advance(t_walk *walk, double *vel, t_grid *grid);
+int earliest_grid_collision(double *pos, double *vel, double R,
+        t_grid *grid, double tmax, double *tcoll, double *peg);
+int next_wall_collision(double *pos, double *vel, double wall, double *tcoll);
 int next_collision(double *pos, double *vel, double R,
-        double *pegs, double npegs, double wall, double *tcoll, double *peg);
+        t_grid *grid, double wall, double *tcoll, double *peg);
+int apply_event(double *pos, double *vel, double damp, int result,
+        double tcoll, double *peg);
 double zero_cross_time(double *p, double *v);
 void create_norm(double *peg, double *pos, double *out);
 
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <complex.h>
+#include "../plinkolib.h"
+#include "quartic.h"
+
+/*===========================================================================
+ *  Root solver benchmark.  Two modes:
+ *      capture <corpus> [nparticles]
+ *          runs the plinko-density board and appends every polynomial that
+ *          reaches the root solver to <corpus> (DEGSIZE raw doubles each)
+ *      replay <corpus>
+ *          runs every solver over the corpus and compares it against a
+ *          long double reference
+ *=========================================================================*/
+#define AGREE_RTOL 1e-9
+
+typedef struct {
+    const char *name;
+    double (*solve)(double *poly);
+    void (*block)(double poly[DEGSIZE][ROOT_BLOCK], double *tmax, double *roots);
+} t_solver;
+
+t_solver solvers[] = {
+    {"isolate",        isolate_smallest_root, NULL},
+    {"isolate_block",  NULL, isolate_smallest_root_block},
+    {"bairstow",       bairstow_smallest_root, NULL},
+    {"durand_kerner",  durand_kerner_smallest_root, NULL},
+    {"quartic_exact1", quartic_exact1_smallest_root, NULL},
+    {"quartic_exact2", quartic_exact2_smallest_root, NULL},
+};
+
+//============================================================================
+// long double reference, built unlike isolate: all four complex roots by
+// Durand-Kerner iteration, whose real parts split [0, bound] into pieces
+// with at most one real root each, which is then bisected to the last bit
+//============================================================================
+long double lqval(double *poly, long double x){
+    return poly[0]+x*(poly[1]+x*(poly[2]+x*(poly[3]+x*(long double)poly[4])));
+}
+
+long double complex lqcval(double *poly, long double complex x){
+    return poly[0]+x*(poly[1]+x*(poly[2]+x*(poly[3]+x*(long double)poly[4])));
+}
+
+long double lbisect(double *poly, long double lo, long double hi){
+    int neg = lqval(poly, lo) < 0;
+    for (int i=0; i<256; i++){
+        long double mid = 0.5L*(lo + hi);
+        if (mid <= lo || mid >= hi) break;
+        if ((lqval(poly, mid) < 0) == neg) lo = mid;
+        else hi = mid;
+    }
+    return 0.5L*(lo + hi);
+}
+
+void lroots(double *poly, long double complex *z){
+    // the usual start, powers of 0.4+0.9i scaled to the roots' bound
+    long double bound = 1 + MAX(MAX(fabs(poly[3]), fabs(poly[2])),
+            MAX(fabs(poly[1]), fabs(poly[0]))) / fabs(poly[4]);
+    long double complex w = 0.4L + 0.9L*I, zn[DEG];
+    int i, j, k;
+
+    z[0] = bound;
+    for (i=1; i<DEG; i++) z[i] = z[i-1]*w;
+
+    for (k=0; k<500; k++){
+        long double change = 0;
+        for (i=0; i<DEG; i++){
+            long double complex den = poly[DEG];
+            for (j=0; j<DEG; j++)
+                if (j != i) den *= z[i] - z[j];
+            zn[i] = den != 0 ? z[i] - lqcval(poly, z[i]) / den : z[i];
+            change = fmaxl(change, cabsl(zn[i] - z[i]) / fmaxl(cabsl(zn[i]), 1));
+        }
+        for (i=0; i<DEG; i++) z[i] = zn[i];
+        if (change < 1e-30L) break;
+    }
+}
+
+double reference_root(double *poly){
+    int i, j, nbreaks = 0;
+    long double complex z[DEG];
+    long double x[DEG], breaks[DEG+2], tmp, fa, fb;
+
+    lroots(poly, z);
+    for (i=0; i<DEG; i++) x[i] = creall(z[i]);
+    for (i=1; i<DEG; i++)
+        for (j=i; j>0 && x[j-1] > x[j]; j--){
+            tmp = x[j]; x[j] = x[j-1]; x[j-1] = tmp;
+        }
+
+    // one break between each two roots, so no piece holds two
+    breaks[nbreaks++] = 0;
+    for (i=1; i<DEG; i++)
+        if (x[i] > 0) breaks[nbreaks++] = MAX(0.5L*(x[i-1] + x[i]), 0);
+    breaks[nbreaks++] = 1 + MAX(MAX(fabs(poly[3]), fabs(poly[2])),
+            MAX(fabs(poly[1]), fabs(poly[0]))) / fabs(poly[4]);
+
+    fa = lqval(poly, breaks[0]);
+    for (i=1; i<nbreaks; i++){
+        if (breaks[i] <= breaks[i-1]) continue;
+        fb = lqval(poly, breaks[i]);
+        if (fb == 0) return breaks[i];
+        if ((fa < 0) != (fb < 0))
+            return lbisect(poly, breaks[i-1], breaks[i]);
+        fa = fb;
+    }
+    return NAN;
+}
+
+//============================================================================
+// the two modes
+//============================================================================
+int capture(const char *filename, int nparticles){
+    double R = 0.75/2;
+    double damp = 0.9;
+    double wall = 14;
+    double top = 7.0;
+
+    t_grid grid;
+    t_result res;
+
+    build_lattice_grid(&grid, LATTICE_HEX, 4, 16, 0, R);
+
+    polycapture = fopen(filename, "wb");
+    if (!polycapture){
+        printf("Could not open %s for writing\n", filename);
+        return 1;
+    }
+
+    ran_seed(123123);
+    for (int i=0; i<nparticles; i++){
+        double pos[2] = { wall/2 - 0.5 + ran_ran2(), top };
+        double vel[2] = { 0, 1e-4 };
+        trackCollision(pos, vel, R, wall, damp, &grid, &res);
+    }
+
+    printf("captured %llu polynomials from %i particles to %s\n",
+            cullstats.ntests - cullstats.nculled, nparticles, filename);
+
+    fclose(polycapture);
+    polycapture = NULL;
+    free_peg_grid(&grid);
+    return 0;
+}
+
+double elapsed(struct timespec *a, struct timespec *b){
+    return (b->tv_sec - a->tv_sec) + 1e-9*(b->tv_nsec - a->tv_nsec);
+}
+
+int replay(const char *filename){
+    FILE *file = fopen(filename, "rb");
+    if (!file){
+        printf("Could not open %s for reading\n", filename);
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long npolys = ftell(file) / (sizeof(double)*DEGSIZE);
+    fseek(file, 0, SEEK_SET);
+
+    double *polys = malloc(sizeof(double)*DEGSIZE*npolys);
+    double *ref = malloc(sizeof(double)*npolys);
+    double *roots = malloc(sizeof(double)*npolys);
+    npolys = fread(polys, sizeof(double)*DEGSIZE, npolys, file);
+    fclose(file);
+
+    long nref = 0;
+    for (long i=0; i<npolys; i++){
+        ref[i] = reference_root(&polys[DEGSIZE*i]);
+        nref += !isnan(ref[i]);
+    }
+
+    printf("%li polynomials, %li with a positive real root\n\n", npolys, nref);
+    printf("%-16s %10s %10s %8s %8s %8s %8s %10s\n", "solver", "ns/solve",
+            "steps", "nan%", "miss%", "extra%", "differ%", "max rel");
+
+    int nsolvers = sizeof(solvers) / sizeof(t_solver);
+    for (int s=0; s<nsolvers; s++){
+        struct timespec t0, t1;
+        double poly[DEGSIZE], block[DEGSIZE][ROOT_BLOCK], broots[ROOT_BLOCK];
+        double tmax[ROOT_BLOCK];
+        for (int k=0; k<ROOT_BLOCK; k++)
+            tmax[k] = INFINITY;
+        ullong steps0 = root_nsteps;
+
+        // solvers are free to overwrite their input
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (solvers[s].solve){
+            for (long i=0; i<npolys; i++){
+                memcpy(poly, &polys[DEGSIZE*i], sizeof(double)*DEGSIZE);
+                roots[i] = solvers[s].solve(poly);
+            }
+        } else {
+            // the tail block is padded with t^4 + 1, which has no roots
+            for (long i=0; i<npolys; i+=ROOT_BLOCK){
+                for (int k=0; k<ROOT_BLOCK; k++)
+                    for (int j=0; j<DEGSIZE; j++)
+                        block[j][k] = i+k < npolys ? polys[DEGSIZE*(i+k)+j] : (j == 0 || j == DEG);
+                solvers[s].block(block, tmax, broots);
+                for (int k=0; k<ROOT_BLOCK && i+k<npolys; k++)
+                    roots[i+k] = broots[k];
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        long nnan = 0, nmiss = 0, nextra = 0, ndiffer = 0;
+        double maxrel = 0, rel;
+        for (long i=0; i<npolys; i++){
+            nnan += isnan(roots[i]);
+            if (isnan(roots[i]) && !isnan(ref[i])) nmiss++;
+            if (!isnan(roots[i]) && isnan(ref[i])) nextra++;
+            if (!isnan(roots[i]) && !isnan(ref[i])){
+                rel = fabs(roots[i] - ref[i]) / fabs(ref[i]);
+                maxrel = MAX(maxrel, rel);
+                ndiffer += rel > AGREE_RTOL;
+            }
+        }
+
+        double denom = MAX(npolys, 1) / 100.0;
+        printf("%-16s %10.1f %10.2f %8.3f %8.3f %8.3f %8.3f %10.2e\n",
+            solvers[s].name, 1e9*elapsed(&t0, &t1)/MAX(npolys, 1),
+            (double)(root_nsteps - steps0)/MAX(npolys, 1),
+            nnan/denom, nmiss/denom, nextra/denom, ndiffer/denom, maxrel);
+    }
+
+    free(polys);
+    free(ref);
+    free(roots);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    if (argc >= 3 && strcmp(argv[1], "capture") == 0)
+        return capture(argv[2], argc > 3 ? atoi(argv[3]) : 1000);
+    if (argc == 3 && strcmp(argv[1], "replay") == 0)
+        return replay(argv[2]);
+
+    printf("Incorrect arguments supplied, must be one of\n");
+    printf("    capture <corpus> [nparticles]\n");
+    printf("    replay <corpus>\n");
+    return 1;
+}
@@ -1,11 +1,15 @@
-#include <stdio.h>
 #include <math.h>
 #include <complex.h>
 #include <string.h>
 #include "quartic.h"
+#include "../counters.h"
 
 #define EPSILON 1e-10
 
+// running total of solver iterations, read by the root benchmark
+unsigned long long int root_nsteps = 0;
+#pragma omp threadprivate(root_nsteps)
+
 //============================================================================
 // These functions are helper functions for quartics using Bairstow's method
 //============================================================================
@@ -40,6 +44,10 @@ void find_root_pair(double *poly, int deg, double *qpoly,
         err = sqrt((u-uo)*(u-uo)/(uo*uo) + (v-vo)*(v-vo)/(vo*vo));
         nsteps++;
     }
+    root_nsteps += nsteps;
+    COUNT(pair_calls);
+    COUNT_HIST(pair_steps, nsteps);
+    if (nsteps == NMAX) COUNT(pair_nmax);
 
     // b^2 - 4*a*c
     double desc = u*u - 4*v;
@@ -80,11 +88,15 @@ double bairstow_smallest_root(double *poly){
     double realroots[DEGSIZE];
     double tpoly[DEGSIZE];
     memcpy(tpoly, poly, sizeof(double)*DEGSIZE);
+    COUNT(bairstow_calls);
 
     find_all_roots(poly, 4, realroots, &nroots);
 
     // if we didn't find any roots, return a nan (only special number)
-    if (nroots == 0) return NAN;
+    if (nroots == 0){
+        COUNT(bairstow_nan);
+        return NAN;
+    }
 
     // otherwise, find the root closest to zero
     double minroot = NAN;
@@ -93,6 +105,7 @@ double bairstow_smallest_root(double *poly){
                 realroots[i] > 0 && qvalr(tpoly, realroots[i]) < 1e-10)
             minroot = realroots[i];
 
+    if (isnan(minroot)) COUNT(bairstow_nan);
     return minroot;
 }
 
@@ -133,18 +146,19 @@ double durand_kerner_smallest_root(double *poly){
 
         p = pn; r = rn; s = sn; t = tn;
 
-        err = (fabs(qval(poly, p)) + fabs(qval(poly, r))
-             + fabs(qval(poly, s)) + fabs(qval(poly, t)))/4;
+        err = (cabs(qval(poly, p)) + cabs(qval(poly, r))
+             + cabs(qval(poly, s)) + cabs(qval(poly, t)))/4;
 
         //printf("%e | %e %e %e %e\n", err, fabs(qval(poly, p)), fabs(qval(poly, r)), fabs(qval(poly, s)), fabs(qval(poly, t)));
     }
+    root_nsteps += steps;
 
     double smallest = 1e100;
     int hasroot = 0;
     double _Complex rr, roots[DEGSIZE];
     roots[0] = p; roots[1] = r; roots[2] = s; roots[3] = t;
 
-    for (int i=0; i<DEGSIZE; i++){
+    for (int i=0; i<DEG; i++){
         rr = roots[i];
         if (fabs(cimag(rr)) < 2*RTOL && creal(rr) > 0 && creal(rr) < smallest){
             smallest = creal(rr); hasroot = 1;
@@ -172,21 +186,11 @@ double quartic_exact1_smallest_root(double *poly){
     double _Complex Q  = cpow((D1 + csqrt(D1*D1 - 4*D0*D0*D0))/2, 1./3);
     double _Complex S  = 0.5*csqrt(-2./3*p + 1./(3*a)*(Q + D0/Q));
 
-    double _Complex desc = -(D1*D1 - 4*D0*D0*D0)/27;
-
     double _Complex x0 = -b/(4*a) - S + 0.5*csqrt(-4*S*S - 2*p + q/S);
     double _Complex x1 = -b/(4*a) - S - 0.5*csqrt(-4*S*S - 2*p + q/S);
     double _Complex x2 = -b/(4*a) + S + 0.5*csqrt(-4*S*S - 2*p - q/S);
     double _Complex x3 = -b/(4*a) + S - 0.5*csqrt(-4*S*S - 2*p - q/S);
 
-    printf("S = %f + %f I\n\n", creal(S), cimag(S));
-    printf("Q = %f + %f I\n\n", creal(Q), cimag(Q));
-    printf("%f + %f I\n\n", creal(desc), cimag(desc));
-    printf("%f + %f I\n", creal(x0), cimag(x0));
-    printf("%f + %f I\n", creal(x1), cimag(x1));
-    printf("%f + %f I\n", creal(x2), cimag(x2));
-    printf("%f + %f I\n", creal(x3), cimag(x3));
-
     double smallest = 1e100;
     int hasroot = 0;
 
@@ -236,11 +240,6 @@ double quartic_exact2_smallest_root(double *poly){
     double _Complex x2 = (-R + csqrt(-(3*A + 2*y - 2*B/R)))/2;
     double _Complex x3 = (-R - csqrt(-(3*A + 2*y - 2*B/R)))/2;
 
-    printf("%f + %f I\n", creal(x0), cimag(x0));
-    printf("%f + %f I\n", creal(x1), cimag(x1));
-    printf("%f + %f I\n", creal(x2), cimag(x2));
-    printf("%f + %f I\n", creal(x3), cimag(x3));
-
     double smallest = 1e100;
     int hasroot = 0;
 
@@ -261,3 +260,235 @@ double quartic_exact2_smallest_root(double *poly){
         return smallest;
     return NAN;
 }
+
+//============================================================================
+// Root isolation for the collision quartic.  The critical points of the
+// quartic (roots of its derivative, a cubic solved in closed form) split the
+// positive axis into intervals where it is monotonic, so the first interval
+// with a sign change holds exactly the smallest positive root.  That root
+// is polished with Newton's method kept inside the bracket by bisection.
+//============================================================================
+double qvalr_deriv(double *poly, double x){
+    return poly[1]+x*(2*poly[2]+x*(3*poly[3]+x*4*poly[4]));
+}
+
+int cubic_real_roots(double b, double c, double d, double *roots){
+    // x^3 + b x^2 + c x + d = 0 via the depressed cubic x = u - b/3
+    double p = c - b*b/3;
+    double q = 2*b*b*b/27 - b*c/3 + d;
+    double shift = -b/3;
+    double desc = q*q/4 + p*p*p/27;
+
+    if (desc > 0){
+        // one real root, written to avoid cancellation between the terms
+        double A = -copysign(cbrt(fabs(q)/2 + sqrt(desc)), q);
+        double B = A != 0 ? -p/(3*A) : 0;
+        roots[0] = A + B + shift;
+        return 1;
+    }
+
+    if (p >= 0){
+        roots[0] = shift;
+        return 1;
+    }
+
+    double m = 2*sqrt(-p/3);
+    double arg = 3*q/(p*m);
+    double theta = acos(MAX(-1.0, MIN(1.0, arg)))/3;
+    roots[0] = m*cos(theta) + shift;
+    roots[1] = m*cos(theta - 2*M_PI/3) + shift;
+    roots[2] = m*cos(theta - 4*M_PI/3) + shift;
+    return 3;
+}
+
+double bracketed_root(double *poly, double lo, double hi){
+    double flo = qvalr(poly, lo);
+    double x = 0.5*(lo + hi), fx, dfx, xn;
+    int i;
+
+    COUNT(isolate_calls);
+    for (i=0; i<ISOLATE_NMAX; i++){
+        root_nsteps++;
+        fx = qvalr(poly, x);
+        if (fx == 0) break;
+        if ((fx < 0) == (flo < 0)){ lo = x; flo = fx; }
+        else hi = x;
+
+        dfx = qvalr_deriv(poly, x);
+        xn = x - fx/dfx;
+        if (!(xn > lo && xn < hi))
+            xn = 0.5*(lo + hi);
+
+        if (fabs(xn - x) <= XTOL*fabs(xn) || hi - lo <= XTOL*fabs(hi)){
+            x = xn;
+            break;
+        }
+        x = xn;
+    }
+    COUNT_HIST(isolate_steps, i + (i < ISOLATE_NMAX));
+    if (i == ISOLATE_NMAX) COUNT(isolate_nmax);
+    return x;
+}
+
+double isolate_smallest_root(double *poly){
+    int i, j, ncrit, nbreaks = 0;
+    double crit[3], breaks[5], tmp, fa, fb;
+
+    // critical points from the monic derivative
+    double a = 4*poly[4];
+    ncrit = cubic_real_roots(3*poly[3]/a, 2*poly[2]/a, poly[1]/a, crit);
+
+    breaks[nbreaks++] = 0;
+    for (i=0; i<ncrit; i++)
+        if (crit[i] > 0) breaks[nbreaks++] = crit[i];
+
+    // Cauchy bound on the largest root closes the last interval
+    breaks[nbreaks++] = 1 + MAX(MAX(fabs(poly[3]), fabs(poly[2])),
+            MAX(fabs(poly[1]), fabs(poly[0]))) / fabs(poly[4]);
+
+    for (i=1; i<nbreaks; i++)
+        for (j=i; j>1 && breaks[j-1] > breaks[j]; j--){
+            tmp = breaks[j]; breaks[j] = breaks[j-1]; breaks[j-1] = tmp;
+        }
+
+    fa = qvalr(poly, breaks[0]);
+    for (i=1; i<nbreaks; i++){
+        fb = qvalr(poly, breaks[i]);
+        if (fb == 0) return breaks[i];
+        if ((fa < 0) != (fb < 0))
+            return bracketed_root(poly, breaks[i-1], breaks[i]);
+        fa = fb;
+    }
+    return NAN;
+}
+
+//============================================================================
+// The same isolation on ROOT_BLOCK polynomials at once, stored by
+// coefficient (poly[i][k] is coefficient i of polynomial k).  To vectorize
+// it uses only arithmetic and sqrt: the roots of the quadratic p'' bracket
+// the critical points, which are polished like the root itself by a fixed
+// number of bracketed Newton steps.  Branches are selects, and the rare
+// lanes that have not converged by then are finished by
+// isolate_smallest_root.  All lanes run the same code, so a polynomial's
+// root does not depend on its position in the block.
+//============================================================================
+#define SIGN(x) copysign(1.0, x)
+
+#pragma omp declare simd
+static inline double block_newton(double a0, double a1, double a2, double a3,
+        double a4, double lo, double hi, int niters, double *err){
+    // root of a0 + a1 x + .. + a4 x^4 in [lo, hi], given a sign change there
+    // the sign at lo never changes, signs are kept as doubles to vectorize
+    double slo = SIGN(a0+lo*(a1+lo*(a2+lo*(a3+lo*a4))));
+    double x = 0.5*(lo + hi), xn = x, fx, dfx, step;
+
+    #pragma GCC unroll 16
+    for (int i=0; i<niters; i++){
+        fx = a0+x*(a1+x*(a2+x*(a3+x*a4)));
+        lo = SIGN(fx) == slo ? x : lo;
+        hi = SIGN(fx) == slo ? hi : x;
+
+        dfx = a1+x*(2*a2+x*(3*a3+x*4*a4));
+        step = fx/dfx;
+        xn = (x - step > lo && x - step < hi) ? x - step : 0.5*(lo + hi);
+        // a step too small to move x has converged, keep it there
+        xn = x - step == x ? x : xn;
+        if (i < niters-1) x = xn;
+    }
+    // relative size of the last step, or of the bracket if that is smaller
+    *err = MIN(fabs(xn - x)/fabs(xn), (hi - lo)/fabs(hi));
+    return xn;
+}
+
+void isolate_smallest_root_block(double poly[DEGSIZE][ROOT_BLOCK],
+        double *tmax, double *roots){
+    double err[ROOT_BLOCK];
+
+    #pragma omp simd
+    for (int k=0; k<ROOT_BLOCK; k++){
+        double c0 = poly[0][k], c1 = poly[1][k], c2 = poly[2][k];
+        double c3 = poly[3][k], c4 = poly[4][k];
+        double e;
+
+        // nothing past tmax is wanted, which tightens the brackets
+        double bound = 1 + MAX(MAX(fabs(c3), fabs(c2)), MAX(fabs(c1), fabs(c0))) / fabs(c4);
+        bound = MIN(bound, tmax[k]);
+
+        // p' = d0 + d1 t + d2 t^2 + d3 t^3 is monotone between the roots of p''
+        double d0 = c1, d1 = 2*c2, d2 = 3*c3, d3 = 4*c4;
+        double bd = 1 + MAX(MAX(fabs(d0), fabs(d1)), fabs(d2)) / fabs(d3);
+        bd = MIN(bd, bound);
+        double desc = d2*d2 - 3*d1*d3;
+        double sq = sqrt(MAX(desc, 0));
+        double u0 = desc > 0 ? (-d2 - copysign(sq, d3))/(3*d3) : 0;
+        double u1 = desc > 0 ? (-d2 + copysign(sq, d3))/(3*d3) : 0;
+        u0 = MIN(MAX(u0, 0), bd);
+        u1 = MIN(MAX(u1, 0), bd);
+
+        // one critical point per piece with a sign change of p', otherwise
+        // a harmless extra break at the left end of the piece
+        double g0 = d0;
+        double g1 = d0+u0*(d1+u0*(d2+u0*d3));
+        double g2 = d0+u1*(d1+u1*(d2+u1*d3));
+        double g3 = d0+bd*(d1+bd*(d2+bd*d3));
+        double e0, e1, e2;
+        double r0 = block_newton(d0, d1, d2, d3, 0, 0, u0, ROOT_BLOCK_CRIT_ITERS, &e0);
+        double r1 = block_newton(d0, d1, d2, d3, 0, u0, u1, ROOT_BLOCK_CRIT_ITERS, &e1);
+        double r2 = block_newton(d0, d1, d2, d3, 0, u1, bd, ROOT_BLOCK_CRIT_ITERS, &e2);
+        double s0 = SIGN(g0) != SIGN(g1) ? r0 : 0;
+        double s1 = SIGN(g1) != SIGN(g2) ? r1 : u0;
+        double s2 = SIGN(g2) != SIGN(g3) ? r2 : u1;
+        e0 = SIGN(g0) != SIGN(g1) ? e0 : 0;
+        e1 = SIGN(g1) != SIGN(g2) ? e1 : 0;
+        e2 = SIGN(g2) != SIGN(g3) ? e2 : 0;
+
+        // first of [0,s0], [s0,s1], [s1,s2], [s2,bound] with a sign change
+        double f0 = c0;
+        double f1 = c0+s0*(c1+s0*(c2+s0*(c3+s0*c4)));
+        double f2 = c0+s1*(c1+s1*(c2+s1*(c3+s1*c4)));
+        double f3 = c0+s2*(c1+s2*(c2+s2*(c3+s2*c4)));
+        double f4 = c0+bound*(c1+bound*(c2+bound*(c3+bound*c4)));
+        double lo = SIGN(f3) != SIGN(f4) ? s2 : NAN;
+        double hi = SIGN(f3) != SIGN(f4) ? bound : NAN;
+        lo = SIGN(f2) != SIGN(f3) ? s1 : lo;
+        hi = SIGN(f2) != SIGN(f3) ? s2 : hi;
+        lo = SIGN(f1) != SIGN(f2) ? s0 : lo;
+        hi = SIGN(f1) != SIGN(f2) ? s1 : hi;
+        lo = SIGN(f0) != SIGN(f1) ? 0  : lo;
+        hi = SIGN(f0) != SIGN(f1) ? s0 : hi;
+
+        // with no sign change the bracket is NaN and so is the root
+        roots[k] = block_newton(c0, c1, c2, c3, c4, lo, hi, ROOT_BLOCK_ITERS, &e);
+        e = isnan(lo) ? 0 : e;
+
+        // p is flat at a critical point, so those need only about half the
+        // digits to get the sign of p there right
+        err[k] = MAX(e, MAX(MAX(e0, e1), e2)*(XTOL/ROOT_BLOCK_CRIT_XTOL));
+    }
+    root_nsteps += ROOT_BLOCK*(3*ROOT_BLOCK_CRIT_ITERS + ROOT_BLOCK_ITERS);
+    COUNT(block_calls);
+
+    for (int k=0; k<ROOT_BLOCK; k++){
+        if (!(err[k] <= XTOL)){
+            double tpoly[DEGSIZE];
+            for (int i=0; i<DEGSIZE; i++)
+                tpoly[i] = poly[i][k];
+            COUNT(block_fallback);
+            roots[k] = isolate_smallest_root(tpoly);
+            roots[k] = roots[k] <= tmax[k] ? roots[k] : NAN;
+        }
+    }
+}
+
+void smallest_root_block(double poly[DEGSIZE][ROOT_BLOCK],
+        double *tmax, double *roots){
+    /* a block through SMALLEST_ROOT, for the solvers with no block form */
+    double tpoly[DEGSIZE];
+
+    for (int k=0; k<ROOT_BLOCK; k++){
+        for (int i=0; i<DEGSIZE; i++)
+            tpoly[i] = poly[i][k];
+        roots[k] = SMALLEST_ROOT(tpoly);
+        roots[k] = roots[k] <= tmax[k] ? roots[k] : NAN;
+    }
+}
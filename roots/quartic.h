@@ -6,6 +6,30 @@
 #define XTOL    1e-14
 #define RTOL    1e-14
 #define NMAX    (1<<10)
+#define ISOLATE_NMAX 64
+
+/* polynomials per call of the vectorized solver, its fixed Newton step
+ * counts for the roots and the critical points, and how closely the
+ * critical points must converge */
+#define ROOT_BLOCK 8
+#define ROOT_BLOCK_ITERS 8
+#define ROOT_BLOCK_CRIT_ITERS 8
+#define ROOT_BLOCK_CRIT_XTOL 1e-7
+
+/* solver used for peg collisions, choose with -DSMALLEST_ROOT=<name> */
+#ifndef SMALLEST_ROOT
+#define SMALLEST_ROOT isolate_smallest_root
+#endif
+
+/* and by the batch engine a block at a time: isolate's vectorized form, or
+ * with -DSMALLEST_ROOT_BLOCK=smallest_root_block any other solver's, one
+ * polynomial after another */
+#ifndef SMALLEST_ROOT_BLOCK
+#define SMALLEST_ROOT_BLOCK isolate_smallest_root_block
+#endif
+
+extern unsigned long long int root_nsteps;
+#pragma omp threadprivate(root_nsteps)
 
 double qvalr(double *poly, double x);
 double quartic_exact1_smallest_root(double *poly);
@@ -13,4 +37,13 @@ double quartic_exact2_smallest_root(double *poly);
 double bairstow_smallest_root(double *poly);
 double durand_kerner_smallest_root(double *poly);
 
+double qvalr_deriv(double *poly, double x);
+int cubic_real_roots(double b, double c, double d, double *roots);
+double bracketed_root(double *poly, double lo, double hi);
+double isolate_smallest_root(double *poly);
+void isolate_smallest_root_block(double poly[DEGSIZE][ROOT_BLOCK],
+        double *tmax, double *roots);
+void smallest_root_block(double poly[DEGSIZE][ROOT_BLOCK],
+        double *tmax, double *roots);
+
 #endif
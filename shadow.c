@@ -0,0 +1,293 @@
+#include <math.h>
+#include "roots/quartic.h"
+#include "batch.h"
+#include "shadow.h"
+
+typedef long double t_ext;
+
+//============================================================================
+// the double flight, and what in it makes rounding matter
+//============================================================================
+static int near_miss(double *pos, double *vel, double R, double tcoll,
+        double *hit, double *pegs, int npegs){
+    /* whether the arc up to tcoll all but touches a peg it does not hit: a
+     * local minimum of the peg's quartic inside the arc, above zero and
+     * under the distance SHADOW_MISS*R would make it */
+    double poly[DEGSIZE], crit[3], lo[2], hi[2], a, t, p;
+    int ncrit;
+
+    // the quartic is a squared distance less R^2, the box a distance
+    double pad = R + SHADOW_MISS*R;
+    double gap = pad*pad - R*R;
+
+    // the box the arc stays in, as in the long double search below
+    double xend = pos[0] + vel[0]*tcoll;
+    lo[0] = MIN(pos[0], xend) - pad;
+    hi[0] = MAX(pos[0], xend) + pad;
+    hi[1] = pos[1] + (vel[1] > 0 ? vel[1]*vel[1]/2 : 0) + pad;
+    lo[1] = MIN(pos[1], pos[1] + vel[1]*tcoll - tcoll*tcoll/2) - pad;
+
+    for (int i=0; i<npegs; i++){
+        double *peg = &pegs[2*i];
+        if (peg[0] < lo[0] || peg[0] > hi[0] || peg[1] < lo[1] || peg[1] > hi[1]) continue;
+        if (hit && peg[0] == hit[0] && peg[1] == hit[1]) continue;
+
+        build_peg_poly(pos, vel, R, peg, poly);
+        a = 4*poly[4];
+        ncrit = cubic_real_roots(3*poly[3]/a, 2*poly[2]/a, poly[1]/a, crit);
+        for (int k=0; k<ncrit; k++){
+            t = crit[k];
+            if (!(t > 0 && t < tcoll)) continue;
+            p = qvalr(poly, t);
+            if (p > 0 && p < gap) return 1;
+        }
+    }
+    return 0;
+}
+
+int shadow_event(int flags, double *pos, double *vel, double R, int result,
+        double tcoll, double *peg, double *pegs, int npegs){
+    double hit[2], vin[2], norm[2];
+
+    if (!(flags & SHADOW_NEARMISS) && !isnan(tcoll) &&
+            near_miss(pos, vel, R, tcoll, result == RESULT_COLLISION ? peg : NULL, pegs, npegs))
+        flags |= SHADOW_NEARMISS;
+
+    if (result == RESULT_COLLISION){
+        position(pos, vel, tcoll, hit);
+        velocity(vel, tcoll, vin);
+        create_norm(peg, hit, norm);
+        if (fabs(dot(norm, vin)) < SHADOW_GRAZE*sqrt(dot(vin, vin)))
+            flags |= SHADOW_GRAZING;
+    }
+    return flags;
+}
+
+//============================================================================
+// the same flight in long double, by brute force over the pegs
+//============================================================================
+static t_ext ext_eval(t_ext *p, int deg, t_ext x){
+    t_ext v = p[deg];
+    for (int k=deg-1; k>=0; k--) v = v*x + p[k];
+    return v;
+}
+
+static int ext_roots(t_ext *p, int deg, t_ext lo, t_ext hi, t_ext *roots){
+    /* where p changes sign in (lo, hi), in order: bisected to the last bit
+     * between the places its derivative does */
+    t_ext d[DEGSIZE], crit[DEGSIZE+1], a, b, m, fa, fb, fm;
+    int k, n = 0, ncrit = 0;
+
+    if (deg == 1){
+        a = -p[0] / p[1];
+        if (a > lo && a < hi) roots[n++] = a;
+        return n;
+    }
+
+    for (k=1; k<=deg; k++) d[k-1] = k*p[k];
+    crit[ncrit++] = lo;
+    ncrit += ext_roots(d, deg-1, lo, hi, crit+1);
+    crit[ncrit++] = hi;
+
+    for (k=1; k<ncrit; k++){
+        a = crit[k-1]; b = crit[k];
+        fa = ext_eval(p, deg, a);
+        fb = ext_eval(p, deg, b);
+        if ((fa < 0) == (fb < 0)) continue;
+
+        while (1){
+            m = a + (b - a)/2;
+            if (m <= a || m >= b) break;
+            fm = ext_eval(p, deg, m);
+            if ((fm < 0) == (fa < 0)){ a = m; fa = fm; }
+            else b = m;
+        }
+        roots[n++] = a;
+    }
+    return n;
+}
+
+static void ext_position(t_ext *p, t_ext *v, t_ext t, t_ext *out){
+    out[0] = p[0] + v[0]*t;
+    out[1] = p[1] + v[1]*t - t*t/2;
+}
+
+static int ext_next_collision(t_ext *pos, t_ext *vel, t_ext R, t_ext wall,
+        double *pegs, int npegs, t_ext *tcoll, int *peg){
+    int event = RESULT_NOTHING;
+    t_ext tevent = NAN, t, poly[DEGSIZE], roots[DEGSIZE];
+
+    if (wall > 0){
+        t = -pos[0] / vel[0];
+        if (t > 0){ event = RESULT_WALL_LEFT; tevent = t; }
+        t = (wall - pos[0]) / vel[0];
+        if (t > 0 && (isnan(tevent) || tevent > t)){ event = RESULT_WALL_RIGHT; tevent = t; }
+    }
+
+    // the floor, the positive root of y + vy t - t^2/2
+    t_ext disc = vel[1]*vel[1] + 2*pos[1];
+    if (disc > 0){
+        t_ext t0 = vel[1] - sqrtl(disc), t1 = vel[1] + sqrtl(disc);
+        t = t0 > 0 ? t0 : t1;
+        if (t > 0 && (isnan(tevent) || tevent > t)){ event = RESULT_DONE; tevent = t; }
+    }
+    if (isnan(tevent)){
+        *tcoll = NAN;
+        return event;
+    }
+
+    // the box the arc stays in up to tevent, and pegs that can reach it
+    t_ext xend = pos[0] + vel[0]*tevent;
+    t_ext xlo = fminl(pos[0], xend) - R, xhi = fmaxl(pos[0], xend) + R;
+    t_ext ytop = pos[1] + (vel[1] > 0 ? vel[1]*vel[1]/2 : 0) + R;
+    t_ext ylo = pos[1] + vel[1]*tevent - tevent*tevent/2 - R;
+
+    for (int i=0; i<npegs; i++){
+        t_ext px = pegs[2*i+0], py = pegs[2*i+1];
+        if (px < xlo || px > xhi || py > ytop || py < fminl(ylo, pos[1] - R)) continue;
+
+        t_ext dx = pos[0] - px, dy = pos[1] - py;
+        poly[4] = 0.25L;
+        poly[3] = -vel[1];
+        poly[2] = vel[0]*vel[0] + vel[1]*vel[1] - dy;
+        poly[1] = 2*(vel[0]*dx + vel[1]*dy);
+        poly[0] = dx*dx + dy*dy - R*R;
+
+        // a peg wins ties with the walls and floor
+        if (ext_roots(poly, 4, 0, tevent*(1 + 1e-15L), roots) && roots[0] <= tevent){
+            event = RESULT_COLLISION;
+            tevent = roots[0];
+            *peg = i;
+        }
+    }
+
+    *tcoll = tevent;
+    return event;
+}
+
+static int ext_apply_event(t_ext *pos, t_ext *vel, t_ext damp, int result,
+        t_ext tcoll, double *peg){
+    /* apply_event in long double */
+    t_ext norm[2], len, vn;
+
+    if (result == RESULT_NOTHING) return 0;
+    ext_position(pos, vel, tcoll, pos);
+    if (result == RESULT_DONE) return 0;
+
+    vel[1] -= tcoll;
+    if (pos[1] < 0 || vel[0]*vel[0] + vel[1]*vel[1] < EPS) return 0;
+    if (result == RESULT_WALL_LEFT || result == RESULT_WALL_RIGHT) vel[0] *= -1;
+    if (result == RESULT_COLLISION && peg){
+        norm[0] = pos[0] - peg[0];
+        norm[1] = pos[1] - peg[1];
+        len = sqrtl(norm[0]*norm[0] + norm[1]*norm[1]);
+        norm[0] /= len;
+        norm[1] /= len;
+        vn = vel[0]*norm[0] + vel[1]*norm[1];
+        vel[0] -= 2*vn*norm[0];
+        vel[1] -= 2*vn*norm[1];
+    }
+
+    ext_position(pos, vel, EPS, pos);
+    vel[1] -= EPS;
+    vel[0] *= damp;
+    vel[1] *= damp;
+    return 1;
+}
+
+//============================================================================
+// both side by side until they part
+//============================================================================
+typedef struct {
+    double pos[2], vel[2], R, wall, damp;
+    double *pegs;
+    int npegs, maxbounces, started;
+
+    // the double flight as of its last event
+    int rd, live, k;
+    double peg[2];
+
+    int re, ie, ext_live;
+    t_ext epos[2], evel[2];
+    t_shadow *out;
+} t_lockstep;
+
+static void ext_step(t_lockstep *s){
+    /* the long double flight's next event, then how far it is from the
+     * double one's last */
+    t_shadow *out = s->out;
+    t_ext tc;
+    double dev;
+
+    if (s->ext_live && out->ext_nbounces < s->maxbounces){
+        s->re = ext_next_collision(s->epos, s->evel, s->R, s->wall, s->pegs, s->npegs,
+            &tc, &s->ie);
+        s->ext_live = ext_apply_event(s->epos, s->evel, s->damp, s->re, tc,
+            s->ie >= 0 ? &s->pegs[2*s->ie] : NULL);
+        if (s->ext_live) out->ext_nbounces++;
+        else if (s->re == RESULT_DONE) out->ext_xfinal = s->epos[0];
+    }
+
+    if (out->diverged < 0){
+        dev = hypot(s->pos[0] - (double)s->epos[0], s->pos[1] - (double)s->epos[1]);
+        if (s->rd != s->re || s->live != s->ext_live || dev > SHADOW_TOL ||
+                (s->rd == RESULT_COLLISION &&
+                 (s->peg[0] != s->pegs[2*s->ie] || s->peg[1] != s->pegs[2*s->ie+1])))
+            out->diverged = s->k;
+        else
+            out->maxdev = MAX(out->maxdev, dev);
+    }
+    s->k++;
+}
+
+static int lockstep_next(void *ctx, int wait, long *id, double *pos, double *vel){
+    t_lockstep *s = ctx;
+    (void)wait;
+    if (s->started) return 0;
+    s->started = 1;
+    *id = 0;
+    pos[0] = s->pos[0]; pos[1] = s->pos[1];
+    vel[0] = s->vel[0]; vel[1] = s->vel[1];
+    return 1;
+}
+
+static int lockstep_event(void *ctx, long id, int result, double tcoll,
+        double *peg, double *pos, double *vel){
+    /* the batch engine's event, applied here as it is about to apply it */
+    t_lockstep *s = ctx;
+    (void)id;
+    s->pos[0] = pos[0]; s->pos[1] = pos[1];
+    s->vel[0] = vel[0]; s->vel[1] = vel[1];
+    s->peg[0] = peg[0]; s->peg[1] = peg[1];
+    s->rd = result;
+    s->live = apply_event(s->pos, s->vel, s->damp, result, tcoll, s->peg);
+    if (s->live) s->out->nbounces++;
+
+    ext_step(s);
+    return s->out->nbounces < s->maxbounces;
+}
+
+static void lockstep_done(void *ctx, long id, t_result *res){
+    t_lockstep *s = ctx;
+    (void)id;
+    s->out->xfinal = res->xfinal;
+}
+
+void shadow_run(double *pos, double *vel, double R, double wall, double damp,
+        t_grid *grid, double *pegs, int npegs, int maxbounces, t_shadow *out){
+    t_lockstep s = { {pos[0], pos[1]}, {vel[0], vel[1]}, R, wall, damp, pegs, npegs,
+        maxbounces, 0, RESULT_NOTHING, 1, 0, {0, 0}, RESULT_NOTHING, -1, 1,
+        {pos[0], pos[1]}, {vel[0], vel[1]}, out };
+
+    out->nbounces = out->ext_nbounces = 0;
+    out->diverged = -1;
+    out->maxdev = 0;
+    out->xfinal = out->ext_xfinal = NAN;
+
+    // the double flight steps the long double one with each of its events,
+    // which then goes on alone for as long as it outlives it
+    trackCollisionBatchEvents(R, wall, damp, grid, lockstep_next, lockstep_done,
+        lockstep_event, &s);
+    while (s.ext_live && out->ext_nbounces < maxbounces)
+        ext_step(&s);
+}
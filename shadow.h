@@ -0,0 +1,53 @@
+#ifndef __SHADOW_H__
+#define __SHADOW_H__
+
+#include "plinkolib.h"
+
+/*
+ * Shadowing checks: a flight run again in long double beside the double
+ * one, event by event, to find the bounce from which rounding has made
+ * them different flights.  The double flight is the batch engine's, as
+ * plinko writes it, seen through trackCollisionBatchEvents with the
+ * particle on its own in a batch.  The long double run finds its pegs by
+ * brute force over the peg list and its roots by bisection between the
+ * roots of the derivatives, so it shares none of the double solver's
+ * shortcuts.  It costs far more than the flight itself, so only flights
+ * whose events shadow_event flags are meant to get it:
+ *
+ *      SHADOW_LONG         at least longlived bounces
+ *      SHADOW_GRAZING      a peg hit with |cos| of the incidence angle
+ *                          under SHADOW_GRAZE
+ *      SHADOW_NEARMISS     an arc that comes within SHADOW_MISS*R of
+ *                          touching a peg it does not hit: the peg's
+ *                          quartic has a local minimum just above zero,
+ *                          so a slightly different arc would hit it
+ */
+#define SHADOW_LONG     1
+#define SHADOW_GRAZING  2
+#define SHADOW_NEARMISS 4
+
+#define SHADOW_GRAZE 1e-2
+#define SHADOW_MISS  1e-3
+
+// how far apart the two runs may be before they count as diverged
+#define SHADOW_TOL   1e-6
+
+typedef struct {
+    int nbounces, ext_nbounces;
+    int diverged;       // the first bounce at which they differ, -1 if none
+    double maxdev;      // the largest distance between them before that
+    double xfinal, ext_xfinal;
+} t_shadow;
+
+/* flags with the SHADOW_GRAZING and SHADOW_NEARMISS of one event of a
+ * flight, as a t_batch_event is handed it.  SHADOW_LONG is left to the
+ * caller, from the flight's bounces */
+int shadow_event(int flags, double *pos, double *vel, double R, int result,
+        double tcoll, double *peg, double *pegs, int npegs);
+
+/* the flight in double and in long double side by side, for at most
+ * maxbounces bounces.  grid and pegs are the same board */
+void shadow_run(double *pos, double *vel, double R, double wall, double damp,
+        t_grid *grid, double *pegs, int npegs, int maxbounces, t_shadow *out);
+
+#endif
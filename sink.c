@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sink.h"
+
+//============================================================================
+// chunks through the pfile's stream
+//============================================================================
+static int pfile_flush(t_sink *sink){
+    pfile_write(sink->ctx, sink->buf, sink->n);
+    sink->n = 0;
+    return 1;
+}
+
+static int pfile_done(t_sink *sink){
+    if (sink->n > 0) pfile_flush(sink);
+    free(sink->buf);
+    free(sink);
+    return 0;
+}
+
+t_sink *sink_pfile(t_pfile *file, long size){
+    t_sink *sink = calloc(1, sizeof(t_sink));
+    sink->record = file->header.record_size;
+    sink->size = size;
+    sink->buf = malloc(sink->record*size);
+    sink->flush = pfile_flush;
+    sink->close = pfile_done;
+    sink->ctx = file;
+    return sink;
+}
+
+//============================================================================
+// a window of the file mapped at where the records end, moved along as it
+// fills.  The records go around the stream, so its header count is kept here
+//============================================================================
+typedef struct {
+    t_pfile *file;
+    char *map;
+    size_t maplen;
+    off_t end;
+    long nrecords;
+} t_sink_map;
+
+static int map_window(t_sink *sink){
+    t_sink_map *m = sink->ctx;
+    off_t start = m->end / PFILE_PAGE * PFILE_PAGE;
+
+    m->maplen = (m->end - start) + sink->record*sink->size;
+    if (ftruncate(m->file->fd, start + m->maplen)) return 0;
+
+    m->map = mmap(NULL, m->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, m->file->fd, start);
+    if (m->map == MAP_FAILED){
+        m->map = NULL;
+        return 0;
+    }
+    sink->buf = m->map + (m->end - start);
+    sink->n = 0;
+    return 1;
+}
+
+static void unmap_window(t_sink *sink){
+    t_sink_map *m = sink->ctx;
+    if (m->map) munmap(m->map, m->maplen);
+    m->map = NULL;
+    m->end += sink->n*sink->record;
+    m->nrecords += sink->n;
+    sink->n = 0;
+}
+
+static int mmap_flush(t_sink *sink){
+    unmap_window(sink);
+    return map_window(sink);
+}
+
+static int mmap_done(t_sink *sink){
+    t_sink_map *m = sink->ctx;
+    int error = m->map == NULL;
+
+    unmap_window(sink);
+    error |= ftruncate(m->file->fd, m->end) != 0;
+    error |= lseek(m->file->fd, m->end, SEEK_SET) != m->end;
+    m->file->header.nrecords += m->nrecords;
+
+    free(m);
+    free(sink);
+    return error;
+}
+
+t_sink *sink_mmap(t_pfile *file, long size){
+    t_sink *sink = calloc(1, sizeof(t_sink));
+    t_sink_map *m = calloc(1, sizeof(t_sink_map));
+    t_pfile_header *h = &file->header;
+
+    // what went through the stream has to be in the file first
+    stream_flush(file->records);
+    m->file = file;
+    m->end = h->records_offset + h->nrecords*h->record_size;
+
+    sink->record = h->record_size;
+    sink->size = size;
+    sink->flush = mmap_flush;
+    sink->close = mmap_done;
+    sink->ctx = m;
+    if (!map_window(sink)){
+        free(m);
+        free(sink);
+        return NULL;
+    }
+    return sink;
+}
+
+//============================================================================
+// every stride'th record, with the stride doubled each time the kept fill up
+//============================================================================
+typedef struct {
+    char *keep;
+    long nkeep, max;
+    long stride, seen;
+} t_sink_dec;
+
+static int decimate_flush(t_sink *sink){
+    t_sink_dec *d = sink->ctx;
+    size_t r = sink->record;
+
+    for (long i=0; i<sink->n; i++, d->seen++){
+        if (d->seen % d->stride) continue;
+        if (d->nkeep == d->max){
+            for (long k=0; 2*k<d->nkeep; k++)
+                memcpy(d->keep + k*r, d->keep + 2*k*r, r);
+            d->nkeep = (d->nkeep + 1) / 2;
+            d->stride *= 2;
+            if (d->seen % d->stride) continue;
+        }
+        memcpy(d->keep + d->nkeep*r, sink->buf + i*r, r);
+        d->nkeep++;
+    }
+    sink->n = 0;
+    return 1;
+}
+
+static int decimate_done(t_sink *sink){
+    t_sink_dec *d = sink->ctx;
+    free(d->keep);
+    free(d);
+    free(sink->buf);
+    free(sink);
+    return 0;
+}
+
+t_sink *sink_decimate(size_t record, long size){
+    t_sink *sink = calloc(1, sizeof(t_sink));
+    t_sink_dec *d = calloc(1, sizeof(t_sink_dec));
+
+    d->max = MAX(size, 2);
+    d->keep = malloc(record*d->max);
+    d->stride = 1;
+
+    sink->record = record;
+    sink->size = MIN(d->max, 1 << 12);
+    sink->buf = malloc(record*sink->size);
+    sink->flush = decimate_flush;
+    sink->close = decimate_done;
+    sink->ctx = d;
+    return sink;
+}
+
+void *sink_kept(t_sink *sink, long *n, long *stride){
+    t_sink_dec *d = sink->ctx;
+    if (sink->n > 0) decimate_flush(sink);
+    *n = d->nkeep;
+    *stride = d->stride;
+    return d->keep;
+}
+
+int sink_close(t_sink *sink){
+    return sink->close(sink);
+}
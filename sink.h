@@ -0,0 +1,32 @@
+#ifndef __SINK_H__
+#define __SINK_H__
+
+#include "plinkolib.h"
+#include "pfile.h"
+
+/*
+ * Ready made t_sinks, each holding only a fixed amount in memory however
+ * long the trajectory runs:
+ *
+ *      sink_pfile      appends each full chunk of size records to a
+ *                      t_pfile through its stream
+ *      sink_mmap       puts records straight into the t_pfile's mapping,
+ *                      which is grown and moved along size records at a time
+ *      sink_decimate   keeps at most size records in memory, evenly spread
+ *                      over the whole flight: once full, every other one is
+ *                      dropped and from then on only every other is kept
+ *
+ * The t_pfile must hold fixed size records of the sink's record size.
+ * sink_close takes what is still in buf, finishes what the sink was doing
+ * and frees it, nonzero on an error.
+ */
+t_sink *sink_pfile(t_pfile *file, long size);
+t_sink *sink_mmap(t_pfile *file, long size);
+t_sink *sink_decimate(size_t record, long size);
+
+/* the records sink_decimate kept, one per stride of those put */
+void *sink_kept(t_sink *sink, long *n, long *stride);
+
+int sink_close(t_sink *sink);
+
+#endif
@@ -0,0 +1,112 @@
+#include <string.h>
+#include <math.h>
+#include "stats.h"
+
+static int bin(double v){
+    if (!(v >= 1)) return 0;
+    int k = 1 + (int)floor(STATS_OCTAVE*log2(v));
+    return MIN(k, STATS_BINS-1);
+}
+
+double stats_bin_edge(int k){
+    return k ? exp2((double)(k-1) / STATS_OCTAVE) : 0;
+}
+
+static void moments_add(t_moments *m, double v){
+    m->n++;
+    double d = v - m->mean;
+    m->mean += d / m->n;
+    m->m2 += d * (v - m->mean);
+}
+
+static void moments_merge(t_moments *to, t_moments *from){
+    // Chan et al., the pairwise form of Welford's update
+    ullong n = to->n + from->n;
+    if (!from->n) return;
+    double d = from->mean - to->mean;
+    to->mean += d * from->n / n;
+    to->m2 += from->m2 + d*d * ((double)to->n * from->n / n);
+    to->n = n;
+}
+
+double moments_var(t_moments *m){
+    return m->n > 1 ? m->m2 / (m->n - 1) : NAN;
+}
+
+void stats_init(t_stats *s){
+    memset(s, 0, sizeof(t_stats));
+}
+
+void stats_add(t_stats *s, t_result *res){
+    s->n++;
+    s->bounces[bin(res->nbounces)]++;
+    s->times[bin(res->time_total)]++;
+    moments_add(&s->mbounces, res->nbounces);
+    moments_add(&s->mtime, res->time_total);
+
+    if (isnan(res->xfinal)){
+        s->lost++;
+        return;
+    }
+    s->cups[MIN(MAX((int)floor(res->xfinal), 0), MAXCUPS-1)]++;
+    moments_add(&s->mx, res->xfinal);
+}
+
+void stats_merge(t_stats *to, t_stats *from){
+    to->n += from->n;
+    to->lost += from->lost;
+    for (int k=0; k<MAXCUPS; k++)
+        to->cups[k] += from->cups[k];
+    for (int k=0; k<STATS_BINS; k++){
+        to->bounces[k] += from->bounces[k];
+        to->times[k] += from->times[k];
+    }
+    moments_merge(&to->mbounces, &from->mbounces);
+    moments_merge(&to->mtime, &from->mtime);
+    moments_merge(&to->mx, &from->mx);
+}
+
+static void print_moments(FILE *out, const char *name, t_moments *m){
+    fprintf(out, "%-8s n %llu mean %.10g std %.10g\n", name, m->n, m->mean, sqrt(moments_var(m)));
+}
+
+void stats_print(FILE *out, t_stats *s){
+    fprintf(out, "%llu particles, %llu lost\n", s->n, s->lost);
+    print_moments(out, "bounces", &s->mbounces);
+    print_moments(out, "time", &s->mtime);
+    print_moments(out, "xfinal", &s->mx);
+
+    int last = MAXCUPS-1;
+    while (last > 0 && !s->cups[last]) last--;
+    fprintf(out, "cups:");
+    for (int k=0; k<=last; k++)
+        fprintf(out, " %.5f", (double)s->cups[k] / MAX(s->n, 1));
+    fprintf(out, "\n");
+}
+
+static void write_hist(FILE *out, const char *name, ullong *hist){
+    fprintf(out, "# %s: lo hi count\n", name);
+    for (int k=0; k<STATS_BINS; k++)
+        if (hist[k])
+            fprintf(out, "%.10g %.10g %llu\n", stats_bin_edge(k),
+                k < STATS_BINS-1 ? stats_bin_edge(k+1) : INFINITY, hist[k]);
+}
+
+int stats_write(const char *filename, t_stats *s){
+    FILE *out = fopen(filename, "w");
+    if (!out) return 1;
+
+    fprintf(out, "# particles: n lost\n%llu %llu\n", s->n, s->lost);
+    fprintf(out, "# moments: name n mean var\n");
+    fprintf(out, "bounces %llu %.17g %.17g\n", s->mbounces.n, s->mbounces.mean, moments_var(&s->mbounces));
+    fprintf(out, "time %llu %.17g %.17g\n", s->mtime.n, s->mtime.mean, moments_var(&s->mtime));
+    fprintf(out, "xfinal %llu %.17g %.17g\n", s->mx.n, s->mx.mean, moments_var(&s->mx));
+
+    fprintf(out, "# cups: cup count\n");
+    for (int k=0; k<MAXCUPS; k++)
+        if (s->cups[k]) fprintf(out, "%i %llu\n", k, s->cups[k]);
+
+    write_hist(out, "bounces", s->bounces);
+    write_hist(out, "time", s->times);
+    return fclose(out);
+}
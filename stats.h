@@ -0,0 +1,52 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include "plinkolib.h"
+
+/*
+ * What a run of particles adds up to, kept in constant memory however
+ * many there are.  It counts:
+ *
+ *      the cup each lands in, unit wide along the floor (the last of
+ *      MAXCUPS takes everything past it), or lost if it never got there
+ *
+ *      histograms of nbounces and time_total, STATS_OCTAVE bins per factor
+ *      of two, bin 0 for values under 1
+ *
+ *      mean and variance of nbounces, time_total and xfinal, by Welford's
+ *      update, the last over the particles that reached the floor
+ *
+ * Each thread adds into its own and stats_merge combines them after.  The
+ * counts are then exact, and the moments are the same up to rounding in
+ * whatever order they were merged.
+ */
+#define STATS_OCTAVE 8
+#define STATS_BINS   (32*STATS_OCTAVE + 1)
+
+typedef struct {
+    ullong n;
+    double mean, m2;
+} t_moments;
+
+typedef struct {
+    ullong n, lost;
+    ullong cups[MAXCUPS];
+    ullong bounces[STATS_BINS];
+    ullong times[STATS_BINS];
+    t_moments mbounces, mtime, mx;
+} t_stats;
+
+void stats_init(t_stats *s);
+void stats_add(t_stats *s, t_result *res);
+void stats_merge(t_stats *to, t_stats *from);
+
+/* the lower edge of histogram bin k */
+double stats_bin_edge(int k);
+double moments_var(t_moments *m);
+
+/* a few lines of summary, and everything as text for analysis */
+void stats_print(FILE *out, t_stats *s);
+int stats_write(const char *filename, t_stats *s);
+
+#endif
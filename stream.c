@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "stream.h"
+
+static void *writer(void *arg){
+    t_stream *stream = arg;
+    size_t n, done;
+    ssize_t w;
+    char *buf;
+
+    pthread_mutex_lock(&stream->lock);
+    while (1){
+        while (!stream->pending && !stream->closing)
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        if (!stream->pending) break;
+
+        buf = stream->buf[!stream->current];
+        n = stream->npending;
+        pthread_mutex_unlock(&stream->lock);
+
+        // a signal before anything is written is not an error, try again
+        for (done=0; done<n; done+=w){
+            w = write(stream->fd, buf+done, n-done);
+            if (w < 0 && errno == EINTR) w = 0;
+            else if (w <= 0) break;
+        }
+
+        pthread_mutex_lock(&stream->lock);
+        if (done < n) stream->error = 1;
+        stream->pending = 0;
+        pthread_cond_broadcast(&stream->cond);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+// give the filled buffer to the writer and switch to the other one
+static void stream_swap(t_stream *stream){
+    pthread_mutex_lock(&stream->lock);
+    while (stream->pending)
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    stream->npending = stream->fill;
+    stream->pending = 1;
+    stream->current = !stream->current;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    stream->fill = 0;
+}
+
+t_stream *stream_open(const char *filename, size_t bufsize){
+    t_stream *stream;
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return NULL;
+
+    stream = stream_fdopen(fd, bufsize);
+    if (!stream) close(fd);
+    return stream;
+}
+
+t_stream *stream_fdopen(int fd, size_t bufsize){
+    t_stream *stream = calloc(1, sizeof(t_stream));
+
+    stream->fd = fd;
+    stream->size = (bufsize + STREAM_ALIGN-1) / STREAM_ALIGN * STREAM_ALIGN;
+    for (int i=0; i<2; i++)
+        if (posix_memalign((void**)&stream->buf[i], STREAM_ALIGN, stream->size))
+            stream->buf[i] = NULL;
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    if (!stream->buf[0] || !stream->buf[1] ||
+            pthread_create(&stream->thread, NULL, writer, stream)){
+        pthread_mutex_destroy(&stream->lock);
+        pthread_cond_destroy(&stream->cond);
+        free(stream->buf[0]);
+        free(stream->buf[1]);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+void stream_write(t_stream *stream, const void *data, size_t nbytes){
+    const char *src = data;
+    size_t n;
+
+    stream->offset += nbytes;
+    while (nbytes > 0){
+        n = stream->size - stream->fill;
+        if (n > nbytes) n = nbytes;
+        memcpy(stream->buf[stream->current] + stream->fill, src, n);
+        stream->fill += n;
+        src += n;
+        nbytes -= n;
+
+        if (stream->fill == stream->size)
+            stream_swap(stream);
+    }
+}
+
+unsigned long long int stream_offset(t_stream *stream){
+    return stream->offset;
+}
+
+int stream_flush(t_stream *stream){
+    int error;
+
+    if (stream->fill > 0)
+        stream_swap(stream);
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->pending)
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    error = stream->error;
+    pthread_mutex_unlock(&stream->lock);
+    return error;
+}
+
+int stream_release(t_stream *stream){
+    int error;
+
+    if (stream->fill > 0)
+        stream_swap(stream);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->closing = 1;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->thread, NULL);
+
+    error = stream->error;
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->cond);
+    free(stream->buf[0]);
+    free(stream->buf[1]);
+    free(stream);
+    return error;
+}
+
+int stream_close(t_stream *stream){
+    int fd = stream->fd;
+    int error = stream_release(stream);
+    if (close(fd)) error = 1;
+    return error;
+}
@@ -0,0 +1,50 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Append-only output through one open file.  Writes are copied into one of
+ * two large page-aligned buffers; a full buffer is handed to a background
+ * thread that writes it out while the caller fills the other, so the
+ * caller only ever waits when the disk falls a whole buffer behind.
+ */
+#define STREAM_ALIGN  4096
+#define STREAM_BUFFER (1 << 22)
+
+typedef struct {
+    int fd;
+    size_t size, fill;
+    char *buf[2];
+    int current;
+    unsigned long long int offset;
+
+    // the buffer handed to the writer thread, if any
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+    size_t npending;
+    int closing, error;
+} t_stream;
+
+/* creates (or truncates) filename, NULL if it can not be opened */
+t_stream *stream_open(const char *filename, size_t bufsize);
+/* the same over an open descriptor, writing from where it stands */
+t_stream *stream_fdopen(int fd, size_t bufsize);
+void stream_write(t_stream *stream, const void *data, size_t nbytes);
+
+/* bytes passed to stream_write so far, where the next write will land */
+unsigned long long int stream_offset(t_stream *stream);
+
+/* waits until everything written so far is in the file, nonzero if any
+ * write has failed */
+int stream_flush(t_stream *stream);
+
+/* writes out what is left and frees the stream, nonzero on a write error.
+ * stream_release leaves the descriptor open, stream_close closes it */
+int stream_release(t_stream *stream);
+int stream_close(t_stream *stream);
+
+#endif
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "plinkolib.h"
+#include "roots/quartic.h"
+#include "sweep.h"
+#include "counters.h"
+
+// how long a worker sleeps while the next particle's result slot is still
+// held by one that an earlier straggler is blocking from being committed
+#define SWEEP_WAIT_NS 100000
+
+struct t_sweep_state {
+    long next, committed;
+    int stop;
+    char *done;
+};
+
+int sweep_next(t_sweep *sweep, long *i, int wait){
+    t_sweep_state *st = sweep->state;
+    long c;
+    int halt, got;
+    struct timespec pause = {0, SWEEP_WAIT_NS};
+
+    while (1){
+        #pragma omp critical(sweep_next)
+        {
+            #pragma omp atomic read
+            c = st->committed;
+            #pragma omp atomic read
+            halt = st->stop;
+
+            got = -1;
+            if (halt || st->next >= sweep->nparticles) got = 0;
+            else if (st->next < c + sweep->window){
+                *i = st->next++;
+                got = 1;
+            }
+        }
+        if (got >= 0 || !wait) return got;
+        nanosleep(&pause, NULL);
+    }
+}
+
+void sweep_done(t_sweep *sweep, long i){
+    t_sweep_state *st = sweep->state;
+    int halt;
+    long c;
+
+    #pragma omp critical(sweep_commit)
+    {
+        st->done[i % sweep->window] = 1;
+        c = st->committed;
+        while (!st->stop && c < sweep->nparticles && st->done[c % sweep->window]){
+            st->done[c % sweep->window] = 0;
+            halt = sweep->commit(c, c % sweep->window, sweep->ctx);
+            c++;
+            #pragma omp atomic write
+            st->committed = c;
+            if (halt){
+                #pragma omp atomic write
+                st->stop = 1;
+            }
+        }
+    }
+}
+
+long sweep_run(t_sweep *sweep){
+    t_sweep_state state = {sweep->start, sweep->start, 0, calloc(sweep->window, 1)};
+    sweep->state = &state;
+
+    // each thread counts into its own copy, folded into the caller's at the end
+    t_cullstats *totalstats = &cullstats;
+    unsigned long long int *totalsteps = &root_nsteps;
+
+    #pragma omp parallel
+    {
+        long i;
+
+        if (sweep->batch)
+            sweep->batch(sweep, sweep->ctx);
+        else {
+            while (sweep_next(sweep, &i, 1) == 1){
+                sweep->work(i, i % sweep->window, sweep->ctx);
+                sweep_done(sweep, i);
+            }
+        }
+
+        // the calling thread must be done counting before others add to it
+        #pragma omp barrier
+        if (&cullstats != totalstats){
+            #pragma omp critical(sweep_stats)
+            {
+                totalstats->ntests += cullstats.ntests;
+                totalstats->nculled += cullstats.nculled;
+                totalstats->nscreened += cullstats.nscreened;
+                totalstats->nhits += cullstats.nhits;
+                *totalsteps += root_nsteps;
+            }
+            cullstats.ntests = cullstats.nculled = cullstats.nscreened = cullstats.nhits = 0;
+            root_nsteps = 0;
+        }
+        COUNTERS_FOLD();
+    }
+
+    free(state.done);
+    sweep->state = NULL;
+    return state.committed;
+}
+
+static int env_int(const char *a, const char *b, int *value){
+    const char *v = getenv(a) ? getenv(a) : getenv(b);
+    if (!v) return 1;
+    *value = atoi(v);
+    return 0;
+}
+
+int sweep_shard_args(int *argc, char **argv, int *shard, int *nshards){
+    *shard = 0;
+    *nshards = 1;
+
+    for (int i=1; i<*argc; i++){
+        if (strcmp(argv[i], "--shard")) continue;
+        if (i+1 == *argc) return 1;
+
+        int bad;
+        if (strcmp(argv[i+1], "mpi") == 0)
+            bad = env_int("OMPI_COMM_WORLD_RANK", "PMI_RANK", shard) |
+                  env_int("OMPI_COMM_WORLD_SIZE", "PMI_SIZE", nshards);
+        else
+            bad = sscanf(argv[i+1], "%d/%d", shard, nshards) != 2;
+
+        for (int j=i; j+2<=*argc; j++)
+            argv[j] = argv[j+2];
+        *argc -= 2;
+        return bad || *nshards < 1 || *shard < 0 || *shard >= *nshards;
+    }
+    return 0;
+}
+
+void sweep_shard(long n, int shard, int nshards, long *first, long *end){
+    // n*shard can be past a long for n near its limit, not for any real run
+    *first = n*shard / nshards;
+    *end = n*(shard+1) / nshards;
+}
@@ -0,0 +1,67 @@
+#ifndef __SWEEP_H__
+#define __SWEEP_H__
+
+/*
+ * A parallel sweep over independent particles.  Workers take the next
+ * particle from a shared counter one at a time, so a few long-lived
+ * trajectories never leave the other threads idle behind a fixed chunk.
+ * Results are handed to commit() strictly in particle order, one call at a
+ * time, so output is the same for any number of threads.
+ *
+ * The sweep covers particles start to nparticles-1, so a run that stopped
+ * part way can pick up from where its commits reached.
+ *
+ * work(i, slot, ctx) computes particle i and leaves its result in the
+ * caller's storage for slot (always i % window).  At most window particles
+ * are held between work() and commit(), which bounds that storage.  A
+ * nonzero return from commit() stops the sweep after that particle.
+ *
+ * Instead of work(), a sweep can give each thread to batch(sweep, ctx),
+ * which keeps many particles in flight at once: it takes them with
+ * sweep_next() and hands each back with sweep_done() once its result is
+ * in the slot's storage.
+ */
+typedef struct t_sweep t_sweep;
+typedef struct t_sweep_state t_sweep_state;
+
+typedef void (*t_sweep_work)(long i, int slot, void *ctx);
+typedef int  (*t_sweep_commit)(long i, int slot, void *ctx);
+typedef void (*t_sweep_batch)(t_sweep *sweep, void *ctx);
+
+struct t_sweep {
+    long start, nparticles;
+    int window;
+    t_sweep_work work;
+    t_sweep_commit commit;
+    void *ctx;
+    t_sweep_batch batch;
+
+    // shared progress while sweep_run is going, leave NULL
+    t_sweep_state *state;
+};
+
+/* returns the index one past the last particle committed */
+long sweep_run(t_sweep *sweep);
+
+/* claim the next particle into *i and return 1, or 0 once there are none
+ * left.  When the next particle's slot is still held this waits for it if
+ * wait is set and otherwise returns -1 at once, to be tried again later */
+int  sweep_next(t_sweep *sweep, long *i, int wait);
+void sweep_done(t_sweep *sweep, long i);
+
+/*
+ * One run split into nshards processes, shard 0 .. nshards-1 of which each
+ * sweeps its own contiguous block of the particles.  The blocks depend
+ * only on n and nshards, so shards can run anywhere in any order and
+ * plinko-merge puts their files back together.
+ */
+
+/* takes "--shard index/nshards" out of argv, or "--shard mpi" for the rank
+ * and size an MPI launcher sets in the environment.  Without it the run
+ * is shard 0 of 1.  Nonzero if it is malformed */
+int  sweep_shard_args(int *argc, char **argv, int *shard, int *nshards);
+
+/* the particles [*first, *end) of 0 .. n-1 that shard gets */
+void sweep_shard(long n, int shard, int nshards, long *first, long *end);
+
+#endif